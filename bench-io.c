@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "plus.h"
+
+// Latency histogram: values below HIST_SUB ns are exact, the rest are
+// bucketed by the most significant bit and HIST_SUB_BITS bits after it,
+// i.e. to within 1/HIST_SUB of the value
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1U << HIST_SUB_BITS)
+#define HIST_SIZE	(64 * HIST_SUB)
+
+#define MAX_THREADS	256
+// Threads reading ahead, with -R
+#define RA_THREADS	4
+// Max age of staged writes with -W, in milliseconds
+#define WB_AGE		1000
+
+enum { RD, WR };
+
+struct stats {
+	u64 ops[2];
+	u64 min[2];
+	u64 max[2];
+	u64 hist[2][HIST_SIZE];
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	struct stats st;
+};
+
+static const char *self; // argv[0]
+
+// Workload parameters
+static struct plus_image *img;
+static off_t img_size;
+static size_t bs = 4096;
+static int random_io = 1;
+static u32 read_pct = 100;
+static u64 nops;		// per thread, or 0 to run for runtime
+static u64 deadline;		// in ns, if running for a time
+static u64 seed = 1;
+static int nthreads = 1;
+
+static void usage(int x)
+{
+	printf("Usage: %s [OPTIONS] BASE_DELTA ... TOP_DELTA\n",
+			basename(self));
+	printf("Runs an I/O workload against a delta chain, "
+			"and reports throughput and latency\n");
+	printf("Options:\n");
+	printf("  -w WORKLOAD	-- read, write, rw, randread, randwrite, "
+			"or randrw (default randread)\n");
+	printf("  -b SIZE	-- block size (default 4k)\n");
+	printf("  -t THREADS	-- number of threads (default 1)\n");
+	printf("  -T SECONDS	-- how long to run (default 10)\n");
+	printf("  -n COUNT	-- number of I/Os per thread, instead of -T\n");
+	printf("  -M PERCENT	-- reads in rw and randrw (default 70)\n");
+	printf("  -C SIZE	-- size of the cluster cache (default 0)\n");
+	printf("  -R SIZE	-- read ahead up to SIZE per stream, "
+			"into the cache (default 0)\n");
+	printf("  -W SIZE	-- stage partial writes of new clusters in up "
+			"to SIZE of memory\n");
+	printf("  -m		-- read lower deltas via mmap\n");
+	printf("  -S SEED	-- random seed (default 1)\n");
+	printf("SIZE can have a k, m, or g suffix. Note that writes "
+			"change the top delta.\n");
+	exit(x);
+}
+
+// Parse a size with an optional suffix, returns 0 on error
+static u64 parse_size(const char *s)
+{
+	char *end;
+	u64 v = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K': v <<= 10; end++; break;
+	case 'm': case 'M': v <<= 20; end++; break;
+	case 'g': case 'G': v <<= 30; end++; break;
+	}
+
+	return *end ? 0 : v;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*, so the same seed gives the same offsets everywhere
+static u64 rng(u64 *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545F4914F6CDD1DULL;
+}
+
+static u32 hist_bucket(u64 ns)
+{
+	if (ns < HIST_SUB) {
+		return ns;
+	}
+	int msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// The smallest value falling into bucket b
+static u64 hist_value(u32 b)
+{
+	if (b < HIST_SUB) {
+		return b;
+	}
+	int msb = b / HIST_SUB + HIST_SUB_BITS - 1;
+	return (u64)(HIST_SUB + b % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+static void account(struct stats *st, int dir, u64 ns)
+{
+	if (!st->ops[dir] || ns < st->min[dir]) {
+		st->min[dir] = ns;
+	}
+	if (ns > st->max[dir]) {
+		st->max[dir] = ns;
+	}
+	st->ops[dir]++;
+	st->hist[dir][hist_bucket(ns)]++;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	u64 s = seed + w->id * 0x9E3779B97F4A7C15ULL;
+	u64 nblocks = img_size / bs;
+	// Sequential workers each start at their own part of the image
+	u64 next = nblocks / nthreads * w->id;
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, bs)) {
+		fprintf(stderr, "Can't allocate buffer\n");
+		exit(1);
+	}
+	// Written data must not be all zeroes, or it's not really written
+	for (size_t i = 0; i < bs / sizeof(u64); i++) {
+		((u64 *)buf)[i] = rng(&s) | 1;
+	}
+
+	for (u64 n = 0; !nops || n < nops; n++) {
+		u64 blk = random_io ? rng(&s) % nblocks : next;
+		next = (blk + 1) % nblocks;
+		int dir = rng(&s) % 100 < read_pct ? RD : WR;
+
+		u64 t = now_ns();
+		if (!nops && t >= deadline) {
+			break;
+		}
+		ssize_t r = dir == RD ?
+			plus_read(img, bs, blk * bs, buf) :
+			plus_write(img, bs, blk * bs, buf);
+		if (r != (ssize_t)bs) {
+			fprintf(stderr, "Error: %s at %llu: %zd\n",
+					dir == RD ? "read" : "write",
+					(unsigned long long)(blk * bs), r);
+			exit(1);
+		}
+		account(&w->st, dir, now_ns() - t);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void merge_stats(struct stats *to, const struct stats *from)
+{
+	for (int d = RD; d <= WR; d++) {
+		if (!from->ops[d]) {
+			continue;
+		}
+		if (!to->ops[d] || from->min[d] < to->min[d]) {
+			to->min[d] = from->min[d];
+		}
+		if (from->max[d] > to->max[d]) {
+			to->max[d] = from->max[d];
+		}
+		to->ops[d] += from->ops[d];
+		for (u32 b = 0; b < HIST_SIZE; b++) {
+			to->hist[d][b] += from->hist[d][b];
+		}
+	}
+}
+
+static u64 percentile(const struct stats *st, int dir, double pct)
+{
+	u64 want = st->ops[dir] * pct / 100;
+	u64 seen = 0;
+
+	for (u32 b = 0; b < HIST_SIZE; b++) {
+		seen += st->hist[dir][b];
+		if (seen > want) {
+			u64 v = hist_value(b);
+			return v < st->max[dir] ? v : st->max[dir];
+		}
+	}
+
+	return st->max[dir];
+}
+
+static void report(const struct stats *st, int dir, double secs)
+{
+	const double pct[] = { 50, 90, 99, 99.9 };
+
+	if (!st->ops[dir]) {
+		return;
+	}
+	printf("  %-5s %10llu ops, %9.0f IOPS, %9.1f MB/s\n",
+			dir == RD ? "read" : "write",
+			(unsigned long long)st->ops[dir],
+			st->ops[dir] / secs, st->ops[dir] * bs / secs / 1e6);
+	printf("        lat us: min %.1f", st->min[dir] / 1e3);
+	for (size_t i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+		printf(", p%g %.1f", pct[i], percentile(st, dir, pct[i]) / 1e3);
+	}
+	printf(", max %.1f\n", st->max[dir] / 1e3);
+}
+
+int main(int argc, char **argv)
+{
+	const char *workload = "randread";
+	u32 mix = 70;
+	int runtime = 10;
+	size_t cache = 0;
+	size_t ra_window = 0;
+	size_t wb_size = 0;
+	int use_mmap = 0;
+	int opt;
+
+	self = argv[0];
+	while ((opt = getopt(argc, argv, "+w:b:t:T:n:M:C:R:W:mS:h")) != -1) {
+		switch (opt) {
+		case 'w':
+			workload = optarg;
+			break;
+		case 'b':
+			bs = parse_size(optarg);
+			if (!bs || bs % 4096) {
+				fprintf(stderr, "Error: block size must be "
+						"a multiple of 4k\n");
+				usage(1);
+			}
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAX_THREADS) {
+				fprintf(stderr, "Error: invalid number "
+						"of threads: %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 'T':
+			runtime = atoi(optarg);
+			break;
+		case 'n':
+			nops = strtoull(optarg, NULL, 10);
+			break;
+		case 'M':
+			mix = atoi(optarg);
+			break;
+		case 'C':
+			cache = parse_size(optarg);
+			break;
+		case 'R':
+			ra_window = parse_size(optarg);
+			break;
+		case 'W':
+			wb_size = parse_size(optarg);
+			break;
+		case 'm':
+			use_mmap = 1;
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	argv += optind; argc -= optind;
+
+	if (argc < 1) {
+		fprintf(stderr, "Error: invalid number of arguments\n");
+		usage(1);
+	}
+	const char *w = workload;
+	random_io = strncmp(w, "rand", 4) == 0;
+	if (random_io) {
+		w += 4;
+	}
+	if (strcmp(w, "read") == 0) {
+		read_pct = 100;
+	} else if (strcmp(w, "write") == 0) {
+		read_pct = 0;
+	} else if (strcmp(w, "rw") == 0) {
+		read_pct = mix;
+	} else {
+		fprintf(stderr, "Error: unknown workload: %s\n", workload);
+		usage(1);
+	}
+	if (ra_window && !cache) {
+		fprintf(stderr, "Error: -R reads ahead into the cache, "
+				"so it needs -C\n");
+		usage(1);
+	}
+	if (runtime < 1 || mix > 100) {
+		fprintf(stderr, "Error: invalid run time or read percentage\n");
+		usage(1);
+	}
+	if (!seed) {
+		seed = 1; // xorshift gets stuck at 0
+	}
+
+	img = plus_open(argc, argv, read_pct == 100 ? O_RDONLY : O_RDWR);
+	if (!img) {
+		return 1;
+	}
+	img_size = (off_t)img->bdevSize * img->clusterSize;
+	if ((off_t)bs > img_size) {
+		fprintf(stderr, "Error: block size is bigger than the image\n");
+		return 1;
+	}
+	if ((cache && plus_cache_setup(img, cache)) ||
+			(use_mmap && plus_mmap_setup(img, 1)) ||
+			(ra_window && plus_readahead_setup(img, RA_THREADS,
+							   ra_window)) ||
+			(wb_size && read_pct < 100 &&
+			 plus_writeback_setup(img, wb_size, WB_AGE))) {
+		return 1;
+	}
+
+	struct worker *workers = calloc(nthreads, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Can't allocate memory\n");
+		return 1;
+	}
+	u64 start = now_ns();
+	deadline = start + runtime * 1000000000ULL;
+	for (int t = 0; t < nthreads; t++) {
+		workers[t].id = t;
+		if (pthread_create(&workers[t].thread, NULL, worker_fn,
+					&workers[t])) {
+			fprintf(stderr, "Can't create thread\n");
+			return 1;
+		}
+	}
+	struct stats *total = calloc(1, sizeof(*total));
+	if (!total) {
+		fprintf(stderr, "Can't allocate memory\n");
+		return 1;
+	}
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		merge_stats(total, &workers[t].st);
+	}
+	if (img->wb) {
+		// Staged writes are only done once written out
+		plus_flush(img);
+	}
+	double secs = (now_ns() - start) / 1e9;
+
+	printf("%s bs=%zu threads=%d: %.2f s\n", workload, bs, nthreads, secs);
+	report(total, RD, secs);
+	report(total, WR, secs);
+
+	free(total);
+	free(workers);
+	// Not measured, but the data must be there for the next run
+	plus_flush(img);
+	plus_close(img);
+
+	return 0;
+}
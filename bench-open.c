@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "plus.h"
+
+static const char *self; // argv[0]
+
+static void usage(int x)
+{
+	printf("Usage: %s [-n ITERATIONS] [-s] BASE_DELTA ... TOP_DELTA\n",
+			basename(self));
+	printf("Measures how long it takes to open a delta chain\n");
+	printf("  -s	-- host mode, share deltas with an already opened image\n");
+	exit(x);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int iter = 10;
+	int shared = 0;
+	int opt;
+
+	self = argv[0];
+	while ((opt = getopt(argc, argv, "+n:sh")) != -1) {
+		switch (opt) {
+		case 'n':
+			iter = atoi(optarg);
+			if (iter < 1) {
+				fprintf(stderr, "Error: invalid number "
+						"of iterations: %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 's':
+			shared = 1;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	argv += optind; argc -= optind;
+
+	if (argc < 1) {
+		fprintf(stderr, "Error: invalid number of arguments\n");
+		usage(1);
+	}
+
+	struct plus_image *keep = NULL;
+	if (shared) {
+		plus_host_setup(0);
+		keep = plus_open(argc, argv, O_RDONLY);
+		if (!keep) {
+			return 1;
+		}
+	}
+
+	double min = 0, total = 0;
+	for (int i = 0; i < iter; i++) {
+		double t = now();
+		struct plus_image *img = plus_open(argc, argv, O_RDONLY);
+		t = now() - t;
+		if (!img) {
+			return 1;
+		}
+		plus_close(img);
+
+		total += t;
+		if (i == 0 || t < min) {
+			min = t;
+		}
+	}
+
+	fprintf(stderr, "%d deltas, %d iterations: "
+			"open min %.3f ms, avg %.3f ms\n",
+			argc, iter, min * 1e3, total / iter * 1e3);
+	plus_close(keep);
+
+	return 0;
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/types.h>
+
+#include <ploop/ploop1_image.h>
+
+#include "plus.h"
+
+// Size of ploop on-disk image header, in 32-bit words
+#define HDR_SIZE_32	16
+
+#define SECTOR_SIZE	512
+
+static const char *self; // argv[0]
+
+static void usage(int x)
+{
+	printf("Usage: %s [OPTIONS] PREFIX\n", basename(self));
+	printf("Generates a synthetic delta chain, PREFIX.0 (the base) "
+			"to PREFIX.N-1 (the top)\n");
+	printf("Options:\n");
+	printf("  -s SIZE	-- image size (default 1G)\n");
+	printf("  -c SIZE	-- cluster size (default 1M)\n");
+	printf("  -l LEVELS	-- number of deltas (default 1)\n");
+	printf("  -d PERCENT	-- clusters allocated in each delta "
+			"(default 50)\n");
+	printf("  -f PERCENT	-- clusters not stored in order, "
+			"i.e. fragmentation (default 0)\n");
+	printf("  -S SEED	-- random seed (default 1)\n");
+	printf("SIZE can have a k, m, or g suffix\n");
+	exit(x);
+}
+
+// Parse a size with an optional suffix, returns 0 on error
+static u64 parse_size(const char *s)
+{
+	char *end;
+	u64 v = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K': v <<= 10; end++; break;
+	case 'm': case 'M': v <<= 20; end++; break;
+	case 'g': case 'G': v <<= 30; end++; break;
+	}
+
+	return *end ? 0 : v;
+}
+
+// xorshift64*, so the same seed gives the same images everywhere
+static u64 rng(u64 *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545F4914F6CDD1DULL;
+}
+
+static int make_delta(const char *name, int level, u64 size, u32 cluster,
+		u32 density, u32 frag, u64 *seed)
+{
+	u32 nclusters = size / cluster;
+	u32 batSize = ((u64)(nclusters + HDR_SIZE_32) * 4 + cluster - 1) /
+		cluster;
+	size_t batLen = (size_t)batSize * cluster;
+	u32 *bat = calloc(1, batLen);
+	u32 *order = malloc((size_t)nclusters * sizeof(*order));
+	void *buf = malloc(cluster);
+	int fd = -1, ret = -1;
+
+	if (!bat || !order || !buf) {
+		fprintf(stderr, "Can't allocate memory\n");
+		goto out;
+	}
+
+	struct ploop_pvd_header *pvd = (struct ploop_pvd_header *)bat;
+	u32 sectors = cluster / SECTOR_SIZE;
+	memcpy(pvd->m_Sig, SIGNATURE_STRUCTURED_DISK_V2, sizeof(pvd->m_Sig));
+	pvd->m_Type = PRL_IMAGE_COMPRESSED;
+	pvd->m_Heads = 16;
+	pvd->m_Sectors = sectors;
+	pvd->m_Cylinders = size / SECTOR_SIZE / (16 * sectors);
+	pvd->m_Size = nclusters;
+	pvd->m_SizeInSectors_v2 = size / SECTOR_SIZE;
+	pvd->m_FirstBlockOffset = batSize * sectors;
+
+	// Which clusters this delta has, in their order in the file
+	u32 n = 0;
+	for (u32 idx = 0; idx < nclusters; idx++) {
+		if (rng(seed) % 100 < density) {
+			order[n++] = idx;
+		}
+	}
+	for (u32 i = 0; i < n; i++) {
+		if (rng(seed) % 100 < frag) {
+			u32 j = rng(seed) % n;
+			u32 t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+	}
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Can't create \"%s\": %m\n", name);
+		goto out;
+	}
+
+	// The data are the same byte all over, but for the first 16 bytes
+	// of each cluster, telling where it came from
+	memset(buf, 'a' + level % 26, cluster);
+	for (u32 i = 0; i < n; i++) {
+		u32 blk = batSize + i;
+		u32 idx = order[i];
+		u32 stamp[4] = { level, idx, blk, 0 };
+
+		memcpy(buf, stamp, sizeof(stamp));
+		if (pwrite(fd, buf, cluster, (off_t)blk * cluster) !=
+				(ssize_t)cluster) {
+			fprintf(stderr, "Can't write \"%s\": %m\n", name);
+			goto out;
+		}
+		bat[HDR_SIZE_32 + idx] = blk;
+	}
+	if (pwrite(fd, bat, batLen, 0) != (ssize_t)batLen || fsync(fd)) {
+		fprintf(stderr, "Can't write \"%s\": %m\n", name);
+		goto out;
+	}
+
+	printf("%s: %u of %u clusters\n", name, n, nclusters);
+	ret = 0;
+
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(bat);
+	free(order);
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	u64 size = 1ULL << 30;
+	u64 cluster = DEF_CLUSTER;
+	int levels = 1;
+	u32 density = 50, frag = 0;
+	u64 seed = 1;
+	int opt;
+
+	self = argv[0];
+	while ((opt = getopt(argc, argv, "s:c:l:d:f:S:h")) != -1) {
+		switch (opt) {
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'c':
+			cluster = parse_size(optarg);
+			break;
+		case 'l':
+			levels = atoi(optarg);
+			break;
+		case 'd':
+			density = atoi(optarg);
+			break;
+		case 'f':
+			frag = atoi(optarg);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	argv += optind; argc -= optind;
+
+	if (argc != 1) {
+		fprintf(stderr, "Error: invalid number of arguments\n");
+		usage(1);
+	}
+	if (cluster < 4096 || (cluster & (cluster - 1)) || cluster > (1U << 30)) {
+		fprintf(stderr, "Error: cluster size must be a power of 2, "
+				"from 4k to 1g\n");
+		usage(1);
+	}
+	size = size / cluster * cluster;
+	if (!size || size / cluster > (1U << 31)) {
+		fprintf(stderr, "Error: invalid image size\n");
+		usage(1);
+	}
+	if (levels < 1 || levels > 100 || density > 100 || frag > 100) {
+		fprintf(stderr, "Error: invalid number of levels, density, "
+				"or fragmentation\n");
+		usage(1);
+	}
+	if (!seed) {
+		seed = 1; // xorshift gets stuck at 0
+	}
+
+	for (int l = 0; l < levels; l++) {
+		char name[4096];
+		snprintf(name, sizeof(name), "%s.%d", argv[0], l);
+		if (make_delta(name, l, size, cluster, density, frag, &seed)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "plus.h"
+#include "plus-int.h"
+
+// Bounce buffers for unaligned I/O.
+//
+// The deltas are opened with O_DIRECT, so the buffer, offset and size of
+// every read and write have to be page-aligned. plus_read() and
+// plus_write() take any, and do whatever is not aligned through
+// page-aligned bounce buffers: the edge pages of the range are read
+// whole (and for a write, modified and written back), and whole pages
+// that the caller's buffer is misaligned with are copied, BOUNCE_SIZE
+// at a time. Aligned requests never get here.
+//
+// The buffers come from a single pool for the whole process, which is
+// lock-free: a buffer is taken by setting its bit in a bitmap with an
+// atomic compare-and-swap, and given back by clearing it, so no thread
+// ever waits for another one here. The memory is allocated once, on
+// first use; if all of the buffers are taken, a temporary one is
+// allocated instead.
+
+#define NR_BOUNCE	64	// bits in the bitmap
+
+static u64 bounce_used;		// bitmap of buffers taken
+static void *bounce_mem;	// NR_BOUNCE buffers, BOUNCE_SIZE each
+static pthread_once_t bounce_once = PTHREAD_ONCE_INIT;
+
+static void bounce_init(void)
+{
+	if (posix_memalign(&bounce_mem, PAGE_SIZE,
+				(size_t)NR_BOUNCE * BOUNCE_SIZE)) {
+		bounce_mem = NULL;
+	}
+}
+
+void *bounce_get(void)
+{
+	pthread_once(&bounce_once, bounce_init);
+
+	u64 used = __atomic_load_n(&bounce_used, __ATOMIC_RELAXED);
+	while (bounce_mem && ~used) {
+		int i = __builtin_ctzll(~used);
+		if (__atomic_compare_exchange_n(&bounce_used, &used,
+					used | (1ULL << i), false,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return bounce_mem + (size_t)i * BOUNCE_SIZE;
+		}
+		// somebody else got there first, used is reloaded
+	}
+
+	void *buf;
+	if (posix_memalign(&buf, PAGE_SIZE, BOUNCE_SIZE)) {
+		return NULL;
+	}
+	return buf;
+}
+
+void bounce_put(void *buf)
+{
+	if (bounce_mem && buf >= bounce_mem &&
+			buf < bounce_mem + (size_t)NR_BOUNCE * BOUNCE_SIZE) {
+		size_t i = (buf - bounce_mem) / BOUNCE_SIZE;
+		__atomic_and_fetch(&bounce_used, ~(1ULL << i),
+				__ATOMIC_RELEASE);
+	} else {
+		free(buf);
+	}
+}
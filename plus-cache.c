@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "plus.h"
+#include "plus-int.h"
+
+// Cluster cache, in front of delta reads.
+//
+// As the deltas are opened with O_DIRECT, nothing is cached by the
+// kernel. This caches whole clusters, keyed by (id, block), where id is
+// the level for per-image caches, or 0 for caches of shared deltas (see
+// plus-host.c), which only ever hold one delta. It uses
+// the 2Q replacement policy, so that a single scan through the image
+// doesn't wash out the frequently used clusters:
+//
+// - a cluster read for the first time goes to the "in" FIFO;
+// - once it falls off the FIFO, only its key is remembered,
+//   in the "out" FIFO of ghost entries;
+// - if it is read again while in "out", it goes to the main LRU list.
+//
+// All the cache state is under a single mutex, but the data is copied
+// to and from cluster buffers outside of it, with the entry pinned.
+// Writes invalidate the clusters they touch, including those that are
+// being read into the cache at the moment. Reads of a cluster that is
+// being read in wait for it, rather than go to the disk as well, as
+// that is what happens when they catch up with readahead (plus-ra.c).
+
+// Share of the cache for the "in" FIFO, and the number of ghost entries
+// to keep in the "out" FIFO, relative to the cache size, in percent
+#define CACHE_IN_PCT	25
+#define CACHE_OUT_PCT	50
+
+// Max number of clusters read ahead with a single preadv()
+#define PREFETCH_BATCH	64
+
+enum {
+	Q_NONE,
+	Q_IN,		// recently added
+	Q_OUT,		// ghost, no data
+	Q_MAIN,		// used more than once
+};
+
+struct cache_ent {
+	u64 key;		// id << 32 | block
+	struct cache_ent *hnext;	// in hash chain
+	struct cache_ent *prev, *next;	// in queue
+	void *data;		// cluster buffer, NULL for ghosts
+	int ref;		// pinned while > 0
+	u8  queue;		// Q_*
+	u8  loading;		// data being read from disk
+	u8  stale;		// invalidated while pinned, or failed to load
+	u8  ahead;		// read ahead, and not used yet
+};
+
+struct cache_queue {
+	struct cache_ent *head, *tail;	// most and least recent
+	u32 len;
+};
+
+struct plus_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;	// some cluster was read in
+	u32 clusterSize;
+	u32 nslots;		// number of cluster buffers
+	u32 kin, kout;		// max length of "in" and "out" queues
+	void *mem;		// all cluster buffers
+	void **free_bufs;	// unused cluster buffers
+	u32 nfree;
+
+	struct cache_ent **hash;
+	u32 hash_mask;
+
+	struct cache_queue in, out, main;
+
+	struct plus_cache_stats stats;
+};
+
+#define KEY(id, blk)	((u64)(id) << 32 | (blk))
+
+static inline u32 hash_key(struct plus_cache *c, u64 key)
+{
+	return (key * 0x9E3779B97F4A7C15ULL >> 32) & c->hash_mask;
+}
+
+static struct cache_ent *lookup(struct plus_cache *c, u64 key)
+{
+	struct cache_ent *e = c->hash[hash_key(c, key)];
+
+	while (e && e->key != key) {
+		e = e->hnext;
+	}
+
+	return e;
+}
+
+static void hash_add(struct plus_cache *c, struct cache_ent *e)
+{
+	u32 h = hash_key(c, e->key);
+
+	e->hnext = c->hash[h];
+	c->hash[h] = e;
+}
+
+static void hash_del(struct plus_cache *c, struct cache_ent *e)
+{
+	struct cache_ent **p = &c->hash[hash_key(c, e->key)];
+
+	while (*p != e) {
+		p = &(*p)->hnext;
+	}
+	*p = e->hnext;
+}
+
+static struct cache_queue *queue(struct plus_cache *c, int q)
+{
+	switch (q) {
+	case Q_IN:
+		return &c->in;
+	case Q_OUT:
+		return &c->out;
+	case Q_MAIN:
+		return &c->main;
+	}
+	return NULL;
+}
+
+static void q_del(struct plus_cache *c, struct cache_ent *e)
+{
+	struct cache_queue *q = queue(c, e->queue);
+
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		q->head = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		q->tail = e->prev;
+	}
+	q->len--;
+	e->queue = Q_NONE;
+}
+
+// Add to the head (the most recent end) of queue
+static void q_add(struct plus_cache *c, struct cache_ent *e, int qn)
+{
+	struct cache_queue *q = queue(c, qn);
+
+	e->prev = NULL;
+	e->next = q->head;
+	if (q->head) {
+		q->head->prev = e;
+	} else {
+		q->tail = e;
+	}
+	q->head = e;
+	q->len++;
+	e->queue = qn;
+}
+
+// Forget about an entry altogether
+static void drop(struct plus_cache *c, struct cache_ent *e)
+{
+	if (e->queue != Q_NONE) {
+		q_del(c, e);
+	}
+	hash_del(c, e);
+	if (e->data) {
+		c->free_bufs[c->nfree++] = e->data;
+	}
+	free(e);
+}
+
+// Find the least recent unpinned entry of a queue
+static struct cache_ent *victim(struct cache_queue *q)
+{
+	struct cache_ent *e = q->tail;
+
+	while (e && e->ref) {
+		e = e->prev;
+	}
+
+	return e;
+}
+
+// Get a free cluster buffer, evicting something if needed.
+// Returns NULL if everything is pinned.
+static void *get_buf(struct plus_cache *c)
+{
+	if (c->nfree) {
+		return c->free_bufs[--c->nfree];
+	}
+
+	struct cache_ent *e = NULL;
+	if (c->in.len > c->kin) {
+		e = victim(&c->in);
+	}
+	if (!e) {
+		e = victim(&c->main);
+	}
+	if (!e) {
+		e = victim(&c->in);
+	}
+	if (!e) {
+		return NULL;
+	}
+	c->stats.evictions++;
+
+	void *data = e->data;
+	e->data = NULL;
+	if (e->queue == Q_IN) {
+		// Remember it was here
+		q_del(c, e);
+		q_add(c, e, Q_OUT);
+		if (c->out.len > c->kout) {
+			drop(c, c->out.tail);
+		}
+	} else {
+		drop(c, e);
+	}
+
+	return data;
+}
+
+struct plus_cache *cache_new(u32 cluster, size_t size)
+{
+	u32 nslots = size / cluster;
+
+	if (nslots == 0) {
+		return NULL;
+	}
+
+	struct plus_cache *c = calloc(1, sizeof(*c));
+	if (!c) {
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->loaded, NULL);
+	c->clusterSize = cluster;
+	c->nslots = nslots;
+	c->kin = MAX(nslots * CACHE_IN_PCT / 100, 1);
+	c->kout = MAX(nslots * CACHE_OUT_PCT / 100, 1);
+
+	// Hash for both real and ghost entries, rounded up to a power of 2
+	u32 nhash = 1;
+	while (nhash < nslots + c->kout) {
+		nhash <<= 1;
+	}
+	c->hash_mask = nhash - 1;
+	c->hash = calloc(nhash, sizeof(*c->hash));
+	c->free_bufs = malloc(nslots * sizeof(*c->free_bufs));
+	if (!c->hash || !c->free_bufs ||
+			posix_memalign(&c->mem, PAGE_SIZE, (size_t)nslots * cluster)) {
+		fprintf(stderr, "%s: can't allocate %u clusters\n",
+				__func__, nslots);
+		c->mem = NULL;
+		cache_free(c);
+		return NULL;
+	}
+	for (u32 i = 0; i < nslots; i++) {
+		c->free_bufs[i] = c->mem + (size_t)i * cluster;
+	}
+	c->nfree = nslots;
+
+	return c;
+}
+
+void cache_free(struct plus_cache *c)
+{
+	if (!c) {
+		return;
+	}
+
+	for (u32 h = 0; h <= c->hash_mask && c->hash; h++) {
+		struct cache_ent *e = c->hash[h];
+		while (e) {
+			struct cache_ent *next = e->hnext;
+			free(e);
+			e = next;
+		}
+	}
+	free(c->hash);
+	free(c->free_bufs);
+	free(c->mem);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->loaded);
+	free(c);
+}
+
+int cache_read(struct plus_cache *c, int id, int fd, u32 blk, u32 off,
+		u32 len, void *buf)
+{
+	u32 cluster = c->clusterSize;
+	u64 key = KEY(id, blk);
+	off_t pos = (off_t)blk * cluster;
+
+	pthread_mutex_lock(&c->lock);
+	struct cache_ent *e = lookup(c, key);
+	if (e && e->data && e->loading && !e->stale) {
+		// being read in by someone else, most likely ahead of us
+		e->ref++;
+		while (e->loading) {
+			pthread_cond_wait(&c->loaded, &c->lock);
+		}
+		if (--e->ref == 0 && e->stale) {
+			drop(c, e);
+			e = NULL;
+		}
+	}
+	if (e && e->data && !e->loading && !e->stale) {
+		// hit
+		c->stats.hits++;
+		if (e->ahead) {
+			e->ahead = 0;
+			c->stats.prefetch_hits++;
+		}
+		if (e->queue == Q_MAIN) {
+			q_del(c, e);
+			q_add(c, e, Q_MAIN);
+		}
+		e->ref++;
+		pthread_mutex_unlock(&c->lock);
+
+		memcpy(buf, e->data + off, len);
+
+		pthread_mutex_lock(&c->lock);
+		if (--e->ref == 0 && e->stale) {
+			drop(c, e);
+		}
+		pthread_mutex_unlock(&c->lock);
+		return 0;
+	}
+
+	c->stats.misses++;
+	if (e && (e->data || e->ref)) {
+		// somebody else is reading it right now, or it's stale
+		pthread_mutex_unlock(&c->lock);
+		return read_block(fd, buf, len, pos + off);
+	}
+
+	int q = Q_IN;
+	if (e) {
+		// it's a ghost, i.e. was recently seen; take it off the queue,
+		// so it is not dropped by get_buf()
+		c->stats.ghost_hits++;
+		q_del(c, e);
+		q = Q_MAIN;
+	} else {
+		e = calloc(1, sizeof(*e));
+		if (!e) {
+			pthread_mutex_unlock(&c->lock);
+			return read_block(fd, buf, len, pos + off);
+		}
+		e->key = key;
+		hash_add(c, e);
+	}
+	void *data = get_buf(c);
+	if (!data) {
+		// everything is pinned, don't cache
+		drop(c, e);
+		pthread_mutex_unlock(&c->lock);
+		return read_block(fd, buf, len, pos + off);
+	}
+	e->data = data;
+	e->loading = 1;
+	e->ref = 1;
+	q_add(c, e, q);
+	pthread_mutex_unlock(&c->lock);
+
+	int ret = read_block(fd, data, cluster, pos);
+	if (!ret) {
+		memcpy(buf, data + off, len);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	e->loading = 0;
+	if (ret) {
+		e->stale = 1;
+	}
+	if (--e->ref == 0 && e->stale) {
+		drop(c, e);
+	}
+	pthread_cond_broadcast(&c->loaded);
+	pthread_mutex_unlock(&c->lock);
+
+	return ret;
+}
+
+// Pin a buffer for block key, to be read ahead. Returns NULL if the block
+// is cached already, or being read, or if there is no room for it.
+static struct cache_ent *prefetch_get(struct plus_cache *c, u64 key)
+{
+	struct cache_ent *e = lookup(c, key);
+	if (e && (e->data || e->ref)) {
+		return NULL;
+	}
+
+	int q = Q_IN;
+	if (e) {
+		// a ghost; as in cache_read(), it goes to the main list
+		q_del(c, e);
+		q = Q_MAIN;
+	} else {
+		e = calloc(1, sizeof(*e));
+		if (!e) {
+			return NULL;
+		}
+		e->key = key;
+		hash_add(c, e);
+	}
+	void *data = get_buf(c);
+	if (!data) {
+		drop(c, e);
+		return NULL;
+	}
+	e->data = data;
+	e->loading = 1;
+	e->ahead = 1;
+	e->ref = 1;
+	q_add(c, e, q);
+
+	return e;
+}
+
+int cache_prefetch(struct plus_cache *c, int id, int fd, u32 blk, u32 n)
+{
+	u32 cluster = c->clusterSize;
+	struct cache_ent *ents[PREFETCH_BATCH];
+	struct iovec iov[PREFETCH_BATCH];
+	int ret = 0;
+
+	while (n > 0 && !ret) {
+		// Take a run of blocks that are not cached yet
+		u32 first = blk, k = 0;
+		pthread_mutex_lock(&c->lock);
+		while (n > 0 && k < PREFETCH_BATCH) {
+			struct cache_ent *e = prefetch_get(c, KEY(id, blk));
+			if (!e && k) {
+				break;
+			}
+			blk++;
+			n--;
+			if (!e) {
+				first = blk;
+				continue;
+			}
+			ents[k] = e;
+			iov[k].iov_base = e->data;
+			iov[k].iov_len = cluster;
+			k++;
+		}
+		pthread_mutex_unlock(&c->lock);
+		if (!k) {
+			break;
+		}
+
+		size_t len = (size_t)k * cluster;
+		ssize_t r = preadv(fd, iov, k, (off_t)first * cluster);
+		if (r != (ssize_t)len) {
+			fprintf(stderr, "Error in preadv(%d, %u, %zu) = %zd: "
+					"%m\n", fd, k, (off_t)first * cluster, r);
+			ret = r < 0 ? -errno : -EIO;
+		}
+
+		pthread_mutex_lock(&c->lock);
+		for (u32 i = 0; i < k; i++) {
+			struct cache_ent *e = ents[i];
+			e->loading = 0;
+			if (ret) {
+				e->stale = 1;
+			}
+			if (--e->ref == 0 && e->stale) {
+				drop(c, e);
+			}
+		}
+		if (!ret) {
+			c->stats.prefetched += k;
+		}
+		pthread_cond_broadcast(&c->loaded);
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	return ret;
+}
+
+void cache_invalidate(struct plus_cache *c, int id, u32 blk)
+{
+	if (!c) {
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	struct cache_ent *e = lookup(c, KEY(id, blk));
+	if (e && e->data) {
+		c->stats.invalidations++;
+		if (e->ref) {
+			// whoever holds it will drop it
+			e->stale = 1;
+		} else {
+			drop(c, e);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+int plus_cache_setup(struct plus_image *img, size_t size)
+{
+	if (!img) {
+		return -EBADF;
+	}
+
+	ra_drain(img);
+	cache_free(img->cache);
+	img->cache = NULL;
+	if (!size) {
+		return 0;
+	}
+	img->cache = cache_new(img->clusterSize, size);
+	if (!img->cache) {
+		return size < img->clusterSize ? -EINVAL : -ENOMEM;
+	}
+
+	return 0;
+}
+
+void cache_stats(struct plus_cache *c, struct plus_cache_stats *st)
+{
+	if (!c) {
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	st->hits += c->stats.hits;
+	st->misses += c->stats.misses;
+	st->ghost_hits += c->stats.ghost_hits;
+	st->evictions += c->stats.evictions;
+	st->invalidations += c->stats.invalidations;
+	st->prefetched += c->stats.prefetched;
+	st->prefetch_hits += c->stats.prefetch_hits;
+	st->size += (u64)(c->nslots - c->nfree) * c->clusterSize;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void plus_cache_stats(struct plus_image *img, struct plus_cache_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	cache_stats(img->cache, st);
+}
@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+
+#include "plus.h"
+
+// Incremental backup: export of the data written since a given level was
+// the top delta (see plus_changed_extents()), and applying such a diff to
+// a raw copy of the image as it was back then.
+//
+// Diff format, all numbers are little-endian:
+//   header:  "PLUSDIFF", u32 version (1), u32 cluster size, u64 image size
+//   records: u64 offset, u64 length, then length bytes of data
+//   end:     u64 ~0, u64 total length of data in the records
+// Records are sorted by offset and don't overlap.
+
+#define DIFF_MAGIC	"PLUSDIFF"
+#define DIFF_VERSION	1
+#define DIFF_END	(~0ULL)
+
+// Size of the data buffer
+#define BUF_SIZE	(8U << 20)
+
+struct diff_hdr {
+	char magic[8];
+	u32 version;
+	u32 cluster;
+	u64 size;
+} __attribute__((packed));
+
+struct diff_rec {
+	u64 offset;
+	u64 len;
+} __attribute__((packed));
+
+static const char *self; // argv[0]
+
+static void usage(int x)
+{
+	printf("Usage: %s -l LEVEL [-o OUTPUT] BASE_DELTA ... TOP_DELTA\n",
+			basename(self));
+	printf("       %s -a RAW_FILE [DIFF]\n", basename(self));
+	printf("Exports the data written since LEVEL was the top delta, "
+			"or applies such a diff\n");
+	printf("  -l LEVEL	-- the level of the previous backup, "
+			"-1 for everything\n");
+	printf("  -o OUTPUT	-- output file (default -, i.e. stdout)\n");
+	printf("  -a RAW_FILE	-- apply a diff (from stdin by default) "
+			"to a raw image\n");
+	exit(x);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t r = write(fd, buf, len);
+		if (r < 0) {
+			fprintf(stderr, "Error writing output: %m\n");
+			return -errno;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+// Returns 0, or -EIO if the input ends short
+static int read_all(int fd, void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t r = read(fd, buf, len);
+		if (r < 0) {
+			fprintf(stderr, "Error reading diff: %m\n");
+			return -errno;
+		}
+		if (r == 0) {
+			fprintf(stderr, "Error: diff is truncated\n");
+			return -EIO;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int write_rec(int fd, u64 offset, u64 len)
+{
+	struct diff_rec rec = {
+		.offset = htole64(offset),
+		.len = htole64(len),
+	};
+
+	return write_all(fd, &rec, sizeof(rec));
+}
+
+// Copy an extent of data to the output, by the kernel if it can
+static int copy_extent(struct plus_image *img, int fd,
+		const struct plus_extent *ext, void *buf, int *no_copy)
+{
+	off_t ipos = ext->pos;
+	off_t off = ext->offset;
+	size_t len = ext->len;
+
+	while (len > 0 && !*no_copy) {
+		ssize_t r = copy_file_range(img->fds[ext->level], &ipos,
+				fd, NULL, len, 0);
+		if (r > 0) {
+			off += r;
+			len -= r;
+			continue;
+		}
+		if (r < 0 && errno != EXDEV && errno != EINVAL &&
+				errno != EOPNOTSUPP && errno != ENOSYS) {
+			fprintf(stderr, "Error in copy_file_range: %m\n");
+			return -errno;
+		}
+		// not supported (e.g. to a pipe), don't try again
+		*no_copy = 1;
+	}
+
+	while (len > 0) {
+		size_t n = len < BUF_SIZE ? len : BUF_SIZE;
+		ssize_t r = plus_read(img, n, off, buf);
+		if (r != (ssize_t)n) {
+			fprintf(stderr, "plus_read: %zd\n", r);
+			return r < 0 ? r : -EIO;
+		}
+		int ret = write_all(fd, buf, n);
+		if (ret) {
+			return ret;
+		}
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int export_diff(struct plus_image *img, int base, int fd)
+{
+	off_t size = (off_t)img->clusterSize * img->bdevSize;
+	struct plus_extent ext[64];
+	const int max = sizeof(ext) / sizeof(ext[0]);
+	u64 total = 0, nrec = 0;
+	int no_copy = 0;
+	void *buf;
+	int ret;
+
+	if (posix_memalign(&buf, 4096, BUF_SIZE)) {
+		fprintf(stderr, "Can't allocate buffer\n");
+		return -ENOMEM;
+	}
+
+	struct diff_hdr hdr = {
+		.magic = DIFF_MAGIC,
+		.version = htole32(DIFF_VERSION),
+		.cluster = htole32(img->clusterSize),
+		.size = htole64(size),
+	};
+	ret = write_all(fd, &hdr, sizeof(hdr));
+
+	double t = now();
+	off_t off = 0;
+	while (!ret && off < size) {
+		int n = plus_changed_extents(img, base, off, size - off,
+				ext, max);
+		if (n < 0) {
+			fprintf(stderr, "plus_changed_extents: %d\n", n);
+			ret = n;
+			break;
+		}
+		// Extents next to each other go into one record, even if
+		// they come from different deltas
+		for (int i = 0; !ret && i < n; ) {
+			int j = i + 1;
+			u64 len = ext[i].len;
+			while (j < n && ext[j].offset ==
+					ext[j - 1].offset + (off_t)ext[j - 1].len) {
+				len += ext[j++].len;
+			}
+			ret = write_rec(fd, ext[i].offset, len);
+			for (; !ret && i < j; i++) {
+				ret = copy_extent(img, fd, &ext[i], buf,
+						&no_copy);
+			}
+			total += len;
+			nrec++;
+		}
+		if (n < max) {
+			break;
+		}
+		off = ext[n - 1].offset + ext[n - 1].len;
+	}
+	if (!ret) {
+		ret = write_rec(fd, DIFF_END, total);
+	}
+	t = now() - t;
+
+	if (!ret) {
+		fprintf(stderr, "Exported %llu bytes changed since level %d "
+				"in %llu records, %.2f s\n",
+				(unsigned long long)total, base,
+				(unsigned long long)nrec, t);
+	}
+	free(buf);
+	return ret;
+}
+
+static int apply_diff(int in, int fd)
+{
+	struct diff_hdr hdr;
+	struct diff_rec rec;
+	u64 total = 0, nrec = 0;
+	off_t prev = 0;
+	void *buf;
+	int ret;
+
+	ret = read_all(in, &hdr, sizeof(hdr));
+	if (ret) {
+		return ret;
+	}
+	if (memcmp(hdr.magic, DIFF_MAGIC, sizeof(hdr.magic)) ||
+			le32toh(hdr.version) != DIFF_VERSION) {
+		fprintf(stderr, "Error: not a diff, or unknown version\n");
+		return -EINVAL;
+	}
+	off_t size = le64toh(hdr.size);
+
+	// The raw copy can't be bigger than the image, but might be
+	// shorter if its tail was never written to
+	struct stat st;
+	if (fstat(fd, &st)) {
+		perror("stat");
+		return -errno;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size != size) {
+		if (st.st_size > size) {
+			fprintf(stderr, "Error: raw image is bigger than "
+					"the diff (%lld > %lld bytes)\n",
+					(long long)st.st_size, (long long)size);
+			return -EINVAL;
+		}
+		if (ftruncate(fd, size)) {
+			perror("ftruncate");
+			return -errno;
+		}
+	}
+
+	if (posix_memalign(&buf, 4096, BUF_SIZE)) {
+		fprintf(stderr, "Can't allocate buffer\n");
+		return -ENOMEM;
+	}
+
+	double t = now();
+	for (;;) {
+		ret = read_all(in, &rec, sizeof(rec));
+		if (ret) {
+			goto out;
+		}
+		off_t off = le64toh(rec.offset);
+		u64 len = le64toh(rec.len);
+		if (le64toh(rec.offset) == DIFF_END) {
+			if (len != total) {
+				fprintf(stderr, "Error: diff is corrupted, "
+						"%llu bytes of data, "
+						"expected %llu\n",
+						(unsigned long long)total,
+						(unsigned long long)len);
+				ret = -EIO;
+			}
+			break;
+		}
+		if (off < prev || off > size || len > (u64)(size - off)) {
+			fprintf(stderr, "Error: diff is corrupted, bad record "
+					"at %lld, length %llu\n", (long long)off,
+					(unsigned long long)len);
+			ret = -EIO;
+			goto out;
+		}
+		prev = off + len;
+		total += len;
+		nrec++;
+
+		while (len > 0) {
+			size_t n = len < BUF_SIZE ? len : BUF_SIZE;
+			ret = read_all(in, buf, n);
+			if (ret) {
+				goto out;
+			}
+			if (pwrite(fd, buf, n, off) != (ssize_t)n) {
+				fprintf(stderr, "Error writing raw image: "
+						"%m\n");
+				ret = -EIO;
+				goto out;
+			}
+			off += n;
+			len -= n;
+		}
+	}
+	if (!ret && fsync(fd)) {
+		perror("fsync");
+		ret = -errno;
+	}
+	t = now() - t;
+
+	if (!ret) {
+		fprintf(stderr, "Applied %llu bytes in %llu records, %.2f s\n",
+				(unsigned long long)total,
+				(unsigned long long)nrec, t);
+	}
+out:
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = "-";
+	const char *raw = NULL;
+	char *end;
+	long base = 0;
+	int have_base = 0;
+	int opt, ret;
+
+	self = argv[0];
+	while ((opt = getopt(argc, argv, "+l:o:a:h")) != -1) {
+		switch (opt) {
+		case 'l':
+			base = strtol(optarg, &end, 10);
+			if (*end || !*optarg || base < -1) {
+				fprintf(stderr, "Error: invalid level: %s\n",
+						optarg);
+				usage(1);
+			}
+			have_base = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'a':
+			raw = optarg;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	argv += optind; argc -= optind;
+
+	if (raw) {
+		if (argc > 1 || have_base) {
+			fprintf(stderr, "Error: invalid arguments\n");
+			usage(1);
+		}
+		int in = argc ? open(argv[0], O_RDONLY) : 0;
+		if (in < 0) {
+			fprintf(stderr, "Can't open %s: %m\n", argv[0]);
+			return 1;
+		}
+		int fd = open(raw, O_WRONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Can't open %s: %m\n", raw);
+			return 1;
+		}
+		ret = apply_diff(in, fd);
+		if (close(fd) && !ret) {
+			perror("close");
+			ret = -errno;
+		}
+		if (ret) {
+			fprintf(stderr, "Apply failed: %s\n", strerror(-ret));
+			return 1;
+		}
+		return 0;
+	}
+
+	if (argc < 1 || !have_base) {
+		fprintf(stderr, "Error: invalid number of arguments\n");
+		usage(1);
+	}
+
+	int fd;
+	if (strcmp(output, "-") == 0) {
+		// The diff goes to stdout, and whatever is printed to stderr
+		fd = dup(1);
+		if (fd < 0 || dup2(2, 1) < 0) {
+			perror("dup");
+			return 1;
+		}
+	} else {
+		fd = open(output, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		if (fd < 0) {
+			fprintf(stderr, "Can't open %s: %m\n", output);
+			return 1;
+		}
+	}
+
+	struct plus_image *img = plus_open(argc, argv, O_RDONLY);
+	fflush(stdout);
+	if (img == NULL) {
+		return 1;
+	}
+	if (base > img->level) {
+		fprintf(stderr, "Error: no level %ld, the top one is %d\n",
+				base, img->level);
+		return 1;
+	}
+
+	ret = export_diff(img, base, fd);
+	if (!ret && fsync(fd) && errno != EINVAL) {
+		perror("fsync");
+		ret = -errno;
+	}
+	if (close(fd) && !ret) {
+		perror("close");
+		ret = -errno;
+	}
+	plus_close(img);
+	if (ret) {
+		fprintf(stderr, "Export failed: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,742 @@
+#define FUSE_USE_VERSION 312
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <fuse.h>
+#include <linux/falloc.h>
+
+#include "plus.h"
+
+#define PAGE_SIZE	4096
+
+#define DEF_THREADS	10
+// Max number of buffers in a write to pass on without copying
+#define MAX_WRITE_BUFS	16
+// Threads reading ahead, with -R
+#define RA_THREADS	4
+// Max age of staged writes with -W, in milliseconds
+#define WB_AGE		1000
+
+// Default interval between metadata commits, in seconds
+#define DEF_COMMIT	5
+
+// The only file we expose, relative to the mount point
+#define IMAGE_PATH	"/image"
+
+// Setting this attribute of the image to a file name takes a snapshot
+#define SNAPSHOT_XATTR	"user.plus.snapshot"
+
+static const char *self; // argv[0]
+
+static struct plus_image *img;
+static off_t img_size;	// size of the exported image, in bytes
+static int readonly;
+static int zero_fd = -1; // /dev/zero, used as a source for holes
+
+// Directory of the top delta, which relative names of new deltas are
+// taken against, as we run in / once daemonized
+static char *top_dir;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Periodic commit thread
+static int commit_interval = DEF_COMMIT;
+static pthread_t commit_thread;
+static pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static int commit_stop;
+
+// Per-thread page-aligned buffer for plus_write(), as O_DIRECT
+// requires aligned memory and FUSE gives us none.
+static pthread_key_t wbuf_key;
+
+struct wbuf {
+	void *ptr;
+	size_t size;
+};
+
+static void usage(int x)
+{
+	printf("Usage: %s [OPTIONS] MOUNTPOINT BASE_DELTA ... TOP_DELTA\n",
+			basename(self));
+	printf("Exposes a ploop delta chain as MOUNTPOINT%s\n", IMAGE_PATH);
+	printf("Options:\n");
+	printf("  -r		-- read-only, do not modify the top delta\n");
+	printf("  -t THREADS	-- number of worker threads (default %d)\n",
+			DEF_THREADS);
+	printf("  -c SECONDS	-- metadata commit interval (default %d),\n"
+	       "		   0 to only commit on fsync\n", DEF_COMMIT);
+	printf("  -p CLUSTERS	-- number of clusters to preallocate at once\n");
+	printf("  -C MEGABYTES	-- size of the cluster cache (default 0)\n");
+	printf("  -m		-- read lower deltas via mmap\n");
+	printf("  -R MEGABYTES	-- read ahead up to this much per stream "
+			"of reads,\n"
+	       "		   into the cluster cache (default 0)\n");
+	printf("  -W MEGABYTES	-- stage partial writes of new clusters "
+			"in memory,\n"
+	       "		   up to this much (default 0)\n");
+	printf("  -s		-- single-threaded mode\n");
+	printf("  -f		-- stay in foreground\n");
+	printf("  -d		-- debug (implies -f)\n");
+	printf("  -o OPT[,OPT]	-- FUSE mount options\n");
+	exit(x);
+}
+
+static void free_wbuf(void *p)
+{
+	struct wbuf *wb = p;
+
+	free(wb->ptr);
+	free(wb);
+}
+
+// Get an aligned per-thread buffer at least size bytes long
+static void *get_wbuf(size_t size)
+{
+	struct wbuf *wb = pthread_getspecific(wbuf_key);
+
+	if (!wb) {
+		wb = calloc(1, sizeof(*wb));
+		if (!wb) {
+			return NULL;
+		}
+		if (pthread_setspecific(wbuf_key, wb)) {
+			free(wb);
+			return NULL;
+		}
+	}
+
+	if (wb->size < size) {
+		free(wb->ptr);
+		wb->size = 0;
+		if (posix_memalign(&wb->ptr, PAGE_SIZE, size)) {
+			wb->ptr = NULL;
+			return NULL;
+		}
+		wb->size = size;
+	}
+
+	return wb->ptr;
+}
+
+static int pf_getattr(const char *path, struct stat *st,
+		struct fuse_file_info *fi)
+{
+	(void)fi;
+
+	memset(st, 0, sizeof(*st));
+	if (strcmp(path, "/") == 0) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+	} else if (strcmp(path, IMAGE_PATH) == 0) {
+		st->st_mode = S_IFREG | (readonly ? 0444 : 0644);
+		st->st_nlink = 1;
+		st->st_size = img_size;
+		st->st_blksize = img->clusterSize;
+	} else {
+		return -ENOENT;
+	}
+
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+
+	return 0;
+}
+
+static int pf_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi,
+		enum fuse_readdir_flags flags)
+{
+	(void)offset;
+	(void)fi;
+	(void)flags;
+
+	if (strcmp(path, "/") != 0) {
+		return -ENOENT;
+	}
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	filler(buf, IMAGE_PATH + 1, NULL, 0, 0);
+
+	return 0;
+}
+
+static int pf_open(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path, IMAGE_PATH) != 0) {
+		return -ENOENT;
+	}
+	if (readonly && (fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EROFS;
+	}
+
+	return 0;
+}
+
+// With the cluster cache, mapped deltas, or staged writes, or when the
+// range can't be spliced, we have to actually read the data. With mapped
+// deltas, it is copied right from the mappings; FUSE frees memory buffers
+// it gets from read_buf, so it can't be given pointers into them.
+static int read_cached(struct fuse_bufvec **bufp, size_t size, off_t offset)
+{
+	struct fuse_bufvec *bv = malloc(sizeof(*bv));
+	void *ptr = NULL;
+	if (!bv || posix_memalign(&ptr, PAGE_SIZE, size ? size : PAGE_SIZE)) {
+		free(bv);
+		return -ENOMEM;
+	}
+
+	ssize_t r = size ? plus_read(img, size, offset, ptr) : 0;
+	if (r < 0) {
+		free(ptr);
+		free(bv);
+		return r;
+	}
+
+	// both are freed by FUSE
+	*bv = FUSE_BUFVEC_INIT(size);
+	bv->buf[0].mem = ptr;
+	*bufp = bv;
+	return 0;
+}
+
+// Instead of reading the data, tell FUSE where it lives, so it can be
+// spliced from delta files right into /dev/fuse without us touching it.
+// The deltas are opened with O_DIRECT, and splicing from those is only
+// dependable for page-aligned ranges, so anything else is read instead.
+static int pf_read_buf(const char *path, struct fuse_bufvec **bufp,
+		size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	(void)path;
+	(void)fi;
+
+	if (offset >= img_size) {
+		size = 0;
+	} else if (offset + (off_t)size > img_size) {
+		size = img_size - offset;
+	}
+
+	if (img->cache || img->mmap || img->wb ||
+			((size_t)offset | size) % PAGE_SIZE) {
+		return read_cached(bufp, size, offset);
+	}
+
+	int max = size / img->clusterSize + 2; // worst case
+	struct plus_extent *ext = malloc(max * sizeof(*ext));
+	struct fuse_bufvec *bv = calloc(1, sizeof(*bv) +
+			max * sizeof(struct fuse_buf));
+	if (!ext || !bv) {
+		free(ext);
+		free(bv);
+		return -ENOMEM;
+	}
+
+	// Blocks of the top delta can be freed by a discard, and reused for
+	// other data before FUSE gets to splice them, so if there are any,
+	// the data are read instead. It's the top as of before the mapping,
+	// as blocks are only ever freed in the top delta.
+	int top = __atomic_load_n(&img->level, __ATOMIC_ACQUIRE);
+	int n = plus_map_extents(img, offset, size, ext, max);
+	int in_top = 0;
+	for (int i = 0; i < n; i++) {
+		in_top |= ext[i].level >= top;
+	}
+	if (n < 0 || in_top) {
+		free(ext);
+		free(bv);
+		return n < 0 ? n : read_cached(bufp, size, offset);
+	}
+
+	bv->count = n;
+	for (int i = 0; i < n; i++) {
+		struct fuse_buf *b = &bv->buf[i];
+		b->size = ext[i].len;
+		if (ext[i].level < 0) {
+			// hole, read zeroes
+			b->flags = FUSE_BUF_IS_FD;
+			b->fd = zero_fd;
+		} else {
+			b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			b->fd = img->fds[ext[i].level];
+			b->pos = ext[i].pos;
+		}
+	}
+	free(ext);
+
+	*bufp = bv;
+	return 0;
+}
+
+static off_t pf_lseek(const char *path, off_t off, int whence,
+		struct fuse_file_info *fi)
+{
+	(void)path;
+	(void)fi;
+
+	// The kernel handles all the other cases itself
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return -EINVAL;
+	}
+	if (off < 0 || off >= img_size) {
+		return -ENXIO;
+	}
+
+	struct plus_extent ext[64];
+	off_t ret = -ENXIO;
+
+	// Extents don't include staged writes
+	if (img->wb) {
+		int r = plus_flush(img);
+		if (r) {
+			return r;
+		}
+	}
+
+	while (off < img_size) {
+		int n = plus_map_extents(img, off, img_size - off,
+				ext, sizeof(ext) / sizeof(ext[0]));
+		if (n <= 0) {
+			ret = n ? n : -ENXIO;
+			goto out;
+		}
+		for (int i = 0; i < n; i++) {
+			if ((ext[i].level >= 0) == (whence == SEEK_DATA)) {
+				ret = ext[i].offset;
+				goto out;
+			}
+		}
+		off = ext[n - 1].offset + ext[n - 1].len;
+	}
+	// no more data; there's an implicit hole at the end
+	if (whence == SEEK_HOLE) {
+		ret = img_size;
+	}
+out:
+	return ret;
+}
+
+static int pf_write_buf(const char *path, struct fuse_bufvec *buf,
+		off_t offset, struct fuse_file_info *fi)
+{
+	(void)path;
+	(void)fi;
+
+	size_t size = fuse_buf_size(buf);
+	if (offset + (off_t)size > img_size) {
+		return -EFBIG;
+	}
+
+	// Page-aligned data in memory, to a page-aligned offset, can be
+	// written as is
+	struct iovec iov[MAX_WRITE_BUFS];
+	size_t n;
+	for (n = 0; n < buf->count && n < MAX_WRITE_BUFS; n++) {
+		const struct fuse_buf *b = &buf->buf[n];
+		if ((b->flags & FUSE_BUF_IS_FD) ||
+				((size_t)b->mem % PAGE_SIZE) ||
+				(b->size % PAGE_SIZE)) {
+			break;
+		}
+		iov[n].iov_base = b->mem;
+		iov[n].iov_len = b->size;
+	}
+	if (n == buf->count && !(offset % PAGE_SIZE)) {
+		return plus_writev(img, iov, n, offset);
+	}
+	// Other data in memory only needs copying where it is misaligned,
+	// which plus_write() takes care of
+	if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+		return plus_write(img, size, offset, buf->buf[0].mem);
+	}
+
+	// Otherwise, copy (or splice) the incoming data into an aligned buffer
+	void *ptr = get_wbuf(size);
+	if (!ptr) {
+		return -ENOMEM;
+	}
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = ptr;
+	ssize_t r = fuse_buf_copy(&dst, buf, 0);
+	if (r < 0) {
+		return r;
+	}
+	if ((size_t)r != size) {
+		return -EIO;
+	}
+
+	return plus_write(img, size, offset, ptr);
+}
+
+static int pf_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void)path;
+	(void)datasync;
+	(void)fi;
+
+	return plus_flush(img);
+}
+
+static int pf_flush(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;
+	(void)fi;
+
+	return plus_flush(img);
+}
+
+// Zero a part of a single page
+static int zero_page(off_t offset, size_t len)
+{
+	void *ptr = get_wbuf(PAGE_SIZE);
+	if (!ptr) {
+		return -ENOMEM;
+	}
+
+	memset(ptr, 0, len);
+	ssize_t r = plus_write(img, len, offset, ptr);
+
+	return r < 0 ? r : 0;
+}
+
+// Punching a hole discards the range, freeing the clusters where possible
+static int pf_fallocate(const char *path, int mode, off_t offset,
+		off_t length, struct fuse_file_info *fi)
+{
+	(void)path;
+	(void)fi;
+
+	if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+		return -EOPNOTSUPP;
+	}
+	if (readonly) {
+		return -EROFS;
+	}
+	if (offset < 0 || length <= 0) {
+		return -EINVAL;
+	}
+	if (offset >= img_size) {
+		return 0;
+	}
+	off_t end = offset + length;
+	if (end > img_size) {
+		end = img_size;
+	}
+
+	// plus_discard() wants whole pages, zero the rest
+	off_t start = (offset + PAGE_SIZE - 1) & ~(off_t)(PAGE_SIZE - 1);
+	off_t stop = end & ~(off_t)(PAGE_SIZE - 1);
+	if (start > stop) {
+		// all within one page
+		return zero_page(offset, end - offset);
+	}
+	int ret = 0;
+	if (offset < start) {
+		ret = zero_page(offset, start - offset);
+	}
+	if (!ret && stop < end) {
+		ret = zero_page(stop, end - stop);
+	}
+	if (!ret && start < stop) {
+		ret = plus_discard(img, stop - start, start);
+	}
+
+	return ret;
+}
+
+// Take a snapshot, i.e. make a new top delta, with
+//	setfattr -n user.plus.snapshot -v NEW_DELTA MOUNTPOINT/image
+static int pf_setxattr(const char *path, const char *name,
+		const char *value, size_t size, int flags)
+{
+	(void)flags;
+
+	if (strcmp(path, IMAGE_PATH) != 0) {
+		return -ENOENT;
+	}
+	if (strcmp(name, SNAPSHOT_XATTR) != 0) {
+		return -ENOTSUP;
+	}
+	if (readonly) {
+		return -EROFS;
+	}
+
+	pthread_mutex_lock(&snapshot_mutex);
+	char *delta;
+	if (size && value[0] == '/') {
+		delta = strndup(value, size);
+	} else if (asprintf(&delta, "%s/%.*s", top_dir,
+				(int)size, value) < 0) {
+		delta = NULL;
+	}
+	if (!delta) {
+		pthread_mutex_unlock(&snapshot_mutex);
+		return -ENOMEM;
+	}
+	int ret = plus_snapshot(img, delta);
+	if (!ret) {
+		// the new delta is the top one now
+		*strrchr(delta, '/') = '\0';
+		free(top_dir);
+		top_dir = delta;
+	} else {
+		free(delta);
+	}
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	return ret;
+}
+
+// Periodically write out the BAT updates accumulated by writes
+static void *commit_fn(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&commit_mutex);
+	while (!commit_stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += commit_interval;
+		pthread_cond_timedwait(&commit_cond, &commit_mutex, &ts);
+		if (commit_stop) {
+			break;
+		}
+		pthread_mutex_unlock(&commit_mutex);
+		plus_flush(img);
+		pthread_mutex_lock(&commit_mutex);
+	}
+	pthread_mutex_unlock(&commit_mutex);
+
+	return NULL;
+}
+
+static void *pf_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	(void)cfg;
+
+	// Allow both directions of data to go through pipes
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+			FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	return NULL;
+}
+
+static const struct fuse_operations pf_ops = {
+	.init		= pf_init,
+	.getattr	= pf_getattr,
+	.readdir	= pf_readdir,
+	.open		= pf_open,
+	.read_buf	= pf_read_buf,
+	.write_buf	= pf_write_buf,
+	.lseek		= pf_lseek,
+	.fsync		= pf_fsync,
+	.flush		= pf_flush,
+	.setxattr	= pf_setxattr,
+	.fallocate	= pf_fallocate,
+};
+
+int main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	int threads = DEF_THREADS;
+	int single = 0, foreground = 0;
+	int prealloc = -1;
+	size_t cache_mb = 0;
+	size_t ra_mb = 0;
+	size_t wb_mb = 0;
+	int use_mmap = 0;
+	int opt, ret = 1;
+
+	self = argv[0];
+	fuse_opt_add_arg(&args, self);
+
+	while ((opt = getopt(argc, argv, "+rt:c:p:C:mR:W:sfdo:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			readonly = 1;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 1) {
+				fprintf(stderr, "Error: invalid number "
+						"of threads: %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 'c':
+			commit_interval = atoi(optarg);
+			if (commit_interval < 0) {
+				fprintf(stderr, "Error: invalid commit "
+						"interval: %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 'p':
+			prealloc = atoi(optarg);
+			if (prealloc < 1) {
+				fprintf(stderr, "Error: invalid number "
+						"of clusters: %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 'C':
+			cache_mb = atol(optarg);
+			break;
+		case 'm':
+			use_mmap = 1;
+			break;
+		case 'R':
+			ra_mb = atol(optarg);
+			break;
+		case 'W':
+			wb_mb = atol(optarg);
+			break;
+		case 's':
+			single = 1;
+			break;
+		case 'd':
+			fuse_opt_add_arg(&args, "-d");
+			/* fall through */
+		case 'f':
+			foreground = 1;
+			break;
+		case 'o':
+			fuse_opt_add_arg(&args, "-o");
+			fuse_opt_add_arg(&args, optarg);
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	argv += optind; argc -= optind;
+
+	if (argc < 2) {
+		fprintf(stderr, "Error: invalid number of arguments\n");
+		usage(1);
+	}
+	if (ra_mb && !cache_mb) {
+		fprintf(stderr, "Error: -R reads ahead into the cache, "
+				"so it needs -C\n");
+		usage(1);
+	}
+	const char *mountpoint = argv[0];
+	argv++; argc--;
+
+	if (pthread_key_create(&wbuf_key, free_wbuf)) {
+		fprintf(stderr, "Can't create thread key\n");
+		goto out_args;
+	}
+
+	zero_fd = open("/dev/zero", O_RDONLY);
+	if (zero_fd < 0) {
+		fprintf(stderr, "Can't open /dev/zero: %m\n");
+		goto out_args;
+	}
+
+	img = plus_open(argc, argv, readonly ? O_RDONLY : O_RDWR);
+	if (!img) {
+		goto out_zero;
+	}
+	top_dir = realpath(argv[argc - 1], NULL);
+	if (!top_dir) {
+		fprintf(stderr, "Can't resolve %s: %m\n", argv[argc - 1]);
+		goto out_close;
+	}
+	*strrchr(top_dir, '/') = '\0';
+	img_size = (off_t)img->clusterSize * img->bdevSize;
+	if (prealloc > 0) {
+		img->preallocChunk = prealloc;
+	}
+	if (cache_mb && plus_cache_setup(img, cache_mb << 20)) {
+		fprintf(stderr, "Can't set up the cluster cache\n");
+		goto out_close;
+	}
+	if (use_mmap && plus_mmap_setup(img, 1)) {
+		fprintf(stderr, "Can't map the deltas\n");
+		goto out_close;
+	}
+
+	struct fuse *fuse = fuse_new(&args, &pf_ops, sizeof(pf_ops), NULL);
+	if (!fuse) {
+		goto out_close;
+	}
+	if (fuse_mount(fuse, mountpoint)) {
+		goto out_destroy;
+	}
+	if (fuse_daemonize(foreground)) {
+		goto out_unmount;
+	}
+	struct fuse_session *se = fuse_get_session(fuse);
+	if (fuse_set_signal_handlers(se)) {
+		goto out_unmount;
+	}
+	// Can only start threads after daemonizing
+	if (ra_mb && plus_readahead_setup(img, RA_THREADS, ra_mb << 20)) {
+		fprintf(stderr, "Can't set up readahead\n");
+		goto out_signals;
+	}
+	if (wb_mb && plus_writeback_setup(img, wb_mb << 20, WB_AGE)) {
+		fprintf(stderr, "Can't set up write-back staging\n");
+		goto out_signals;
+	}
+	int committing = !readonly && commit_interval > 0;
+	if (committing && pthread_create(&commit_thread, NULL, commit_fn, NULL)) {
+		fprintf(stderr, "Can't create commit thread\n");
+		goto out_signals;
+	}
+
+	if (single) {
+		ret = fuse_loop(fuse);
+	} else {
+		// The loop starts a worker for each request that finds no
+		// idle one, up to max_threads; keep them all once started
+		struct fuse_loop_config *cfg = fuse_loop_cfg_create();
+		if (!cfg) {
+			fprintf(stderr, "Can't create loop config\n");
+			ret = -ENOMEM;
+		} else {
+			fuse_loop_cfg_set_clone_fd(cfg, 0);
+			fuse_loop_cfg_set_max_threads(cfg, threads);
+			fuse_loop_cfg_set_idle_threads(cfg, threads);
+			ret = fuse_loop_mt(fuse, cfg);
+			fuse_loop_cfg_destroy(cfg);
+		}
+	}
+	if (ret) {
+		ret = 1;
+	}
+
+	if (committing) {
+		pthread_mutex_lock(&commit_mutex);
+		commit_stop = 1;
+		pthread_cond_signal(&commit_cond);
+		pthread_mutex_unlock(&commit_mutex);
+		pthread_join(commit_thread, NULL);
+	}
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_unmount:
+	fuse_unmount(fuse);
+out_destroy:
+	fuse_destroy(fuse);
+out_close:
+	plus_close(img);
+	free(top_dir);
+out_zero:
+	close(zero_fd);
+out_args:
+	fuse_opt_free_args(&args);
+
+	return ret;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "plus.h"
+#include "plus-int.h"
+
+// Host mode: sharing read-only deltas between images.
+//
+// Many images on a host are often based on the same delta (e.g. an OS
+// template), each with its own top delta. In host mode, a delta opened
+// read-only is looked up by its inode among those already opened by
+// other images in this process, and if found, its file descriptor, BAT
+// mapping and cluster cache are shared, rather than set up anew.
+//
+// Shared deltas are reference counted, and closed once the last image
+// using them is closed. A delta used as a shared one can't be opened
+// for writing.
+
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shared_delta *shared_list;
+static int host_enabled;
+static size_t host_cache_size;
+
+int plus_host_setup(size_t cache_size)
+{
+	pthread_mutex_lock(&host_lock);
+	host_enabled = 1;
+	host_cache_size = cache_size;
+	pthread_mutex_unlock(&host_lock);
+
+	return 0;
+}
+
+int host_mode(void)
+{
+	pthread_mutex_lock(&host_lock);
+	int ret = host_enabled;
+	pthread_mutex_unlock(&host_lock);
+
+	return ret;
+}
+
+// Called with host_lock held
+static struct shared_delta *lookup(const struct stat *st)
+{
+	struct shared_delta *sd = shared_list;
+
+	while (sd && (sd->dev != st->st_dev || sd->ino != st->st_ino)) {
+		sd = sd->next;
+	}
+
+	return sd;
+}
+
+struct shared_delta *host_get(const struct stat *st)
+{
+	pthread_mutex_lock(&host_lock);
+	struct shared_delta *sd = lookup(st);
+	if (sd) {
+		sd->refs++;
+	}
+	pthread_mutex_unlock(&host_lock);
+
+	return sd;
+}
+
+struct shared_delta *host_add(const struct stat *st, int fd, u32 *bat,
+		u32 clusterSize, u32 batSize, u32 bdevSize, u32 allocSize)
+{
+	pthread_mutex_lock(&host_lock);
+	// Someone might have added it while we were opening it
+	struct shared_delta *sd = lookup(st);
+	if (sd) {
+		sd->refs++;
+		goto out;
+	}
+
+	sd = calloc(1, sizeof(*sd));
+	if (!sd) {
+		goto out;
+	}
+	sd->dev = st->st_dev;
+	sd->ino = st->st_ino;
+	sd->refs = 1;
+	sd->fd = fd;
+	sd->bat = bat;
+	sd->clusterSize = clusterSize;
+	sd->batSize = batSize;
+	sd->bdevSize = bdevSize;
+	sd->allocSize = allocSize;
+	if (host_cache_size) {
+		// can do without it
+		sd->cache = cache_new(clusterSize, host_cache_size);
+	}
+	sd->next = shared_list;
+	shared_list = sd;
+
+out:
+	pthread_mutex_unlock(&host_lock);
+	return sd;
+}
+
+void host_put(struct shared_delta *sd)
+{
+	pthread_mutex_lock(&host_lock);
+	if (--sd->refs > 0) {
+		pthread_mutex_unlock(&host_lock);
+		return;
+	}
+	struct shared_delta **p = &shared_list;
+	while (*p != sd) {
+		p = &(*p)->next;
+	}
+	*p = sd->next;
+	pthread_mutex_unlock(&host_lock);
+
+	munmap(sd->bat, (size_t)sd->batSize * sd->clusterSize);
+	close(sd->fd);
+	cache_free(sd->cache);
+	free(sd);
+}
+
+void plus_host_stats(struct plus_cache_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+
+	pthread_mutex_lock(&host_lock);
+	for (struct shared_delta *sd = shared_list; sd; sd = sd->next) {
+		cache_stats(sd->cache, st);
+	}
+	pthread_mutex_unlock(&host_lock);
+}
@@ -0,0 +1,196 @@
+#ifndef _PLUS_INT_H_
+#define _PLUS_INT_H_
+
+// Library internals shared between plus*.c files, not for the users
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "plus.h"
+
+#define PAGE_SIZE	4096
+
+// Size of ploop on-disk image header, in 32-bit words
+#define HDR_SIZE_32	16 // sizeof(struct ploop_pvd_header) / sizeof(u32)
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+
+// Upper limit for a single pread(), as Linux won't do more than ~2G at once
+#define MAX_IO_SIZE	(1UL << 30)
+
+// Sanity checks common for read and write, returns 0 or -errno
+int sanity_checks(const char *func,
+		struct plus_image *img, size_t size, off_t offset, void *buf);
+// Same, except that any alignment goes
+int range_checks(const char *func,
+		struct plus_image *img, size_t size, off_t offset);
+
+// Page-aligned bounce buffers for unaligned I/O, see plus-bounce.c
+#define BOUNCE_SIZE	(64U << 10)
+// Get a buffer of BOUNCE_SIZE bytes, or NULL if out of memory
+void *bounce_get(void);
+void bounce_put(void *buf);
+
+// Read exactly len bytes, returns 0 or -errno
+int read_block(int fd, void *buf, size_t len, off_t pos);
+// Copy len bytes from ifd at ipos to ofd at opos, or zero them if ifd
+// is -1. Returns 0 or -errno.
+int fill_range(struct plus_image *img, int ifd, off_t ipos,
+		int ofd, off_t opos, size_t len);
+// Check if len bytes at buf are all zeroes; len must be a multiple of 64,
+// and buf must be aligned
+bool is_zero(const void *buf, size_t len);
+// Mark a delta as either dirty or clean, given its mapped header
+void mark_in_use(void *ptr, bool inuse);
+
+// The combined map, see plus-map.c
+
+// Number of clusters per map chunk
+#define MAP_CHUNK	(1U << 14)
+
+int map_init(struct plus_image *img);
+void map_free(struct plus_image *img);
+// Memory used by the map, in bytes
+size_t map_mem(struct plus_image *img);
+// Set up map chunk c from arrays of levels and blocks, as when loading
+int map_build_chunk(struct plus_image *img, u32 c, const u8 *lvl,
+		const u32 *blk);
+// Get the mapping of cluster idx; blk of 0 means a hole
+void map_get(struct plus_image *img, u32 idx, int *lvl, u32 *blk);
+// Set the mapping of cluster idx; blk of 0 makes it a hole
+int map_set(struct plus_image *img, u32 idx, int lvl, u32 blk);
+// Same, but only if it is still mapped to (olvl, oblk)
+int map_replace(struct plus_image *img, u32 idx, int olvl, u32 oblk,
+		int lvl, u32 blk);
+// Keep memory that might still be read by someone until map_free()
+void map_retire(struct plus_image *img, void *ptr);
+// Figure out how many clusters, starting from idx and up to max, can be
+// read in one go, i.e. are either all holes, or all live in the same
+// delta and are physically adjacent in it. The mapping of the first
+// cluster is returned in lvl and blk.
+u32 map_run(struct plus_image *img, u32 idx, u32 max, int *lvl, u32 *blk);
+
+// Default number of clusters to preallocate at once
+#define PREALLOC_CHUNK	64
+
+// Allocate a new cluster in the top delta, growing it by preallocChunk
+// clusters if needed. Safe to call from many threads.
+int alloc_cluster(struct plus_image *img, u32 *blk);
+
+// Number of locks serializing allocation of clusters, see plus_write()
+#define NR_CLUSTER_LOCKS	256
+// Number of locks for read-modify-write of partially written pages
+#define NR_PAGE_LOCKS		64
+
+// The write gate, see plus_snapshot(). Writes hold it while they are
+// in progress, keeping the top delta from being switched under them.
+void write_begin(struct plus_image *img);
+// Same, but returns false rather than waiting if the gate is frozen
+bool write_try_begin(struct plus_image *img);
+// Wait for the gate to be unfrozen
+void write_wait(struct plus_image *img);
+void write_end(struct plus_image *img);
+
+// Read sections. A block of the top delta freed by plus_discard() is
+// only reused once the reads that began before it was freed are done,
+// as they might have found it in the map.
+u32 read_begin(struct plus_image *img);
+void read_end(struct plus_image *img, u32 epoch);
+
+// Max number of BAT updates to hold before flushing them
+#define BAT_BATCH	1024
+
+// Write to a cluster not yet in the top delta, which currently lives in
+// block blk of level lvl, or is a hole if blk is 0, from nv buffers. If v
+// is NULL, zero the range instead. Called with the cluster lock held.
+int write_new_cluster(struct plus_image *img, u32 idx, int lvl, u32 blk,
+		u32 off, u32 len, const struct iovec *v, int nv);
+
+// Queue setting the top delta BAT entry for cluster idx.
+// The entry is written to disk by plus_flush().
+int bat_update(struct plus_image *img, u32 idx, u32 cluster);
+
+// Cluster cache, see plus-cache.c
+
+// Create a cache of size bytes, returns NULL if it can't
+struct plus_cache *cache_new(u32 clusterSize, size_t size);
+void cache_free(struct plus_cache *c);
+// Read len bytes at off of block blk of file fd, via the cache
+int cache_read(struct plus_cache *c, int id, int fd, u32 blk, u32 off,
+		u32 len, void *buf);
+// Read n blocks from blk on of file fd into the cache, skipping those
+// that are there already. Returns 0 or -errno.
+int cache_prefetch(struct plus_cache *c, int id, int fd, u32 blk, u32 n);
+// Drop the cached copy of a block, called after it is written to
+void cache_invalidate(struct plus_cache *c, int id, u32 blk);
+// Add the stats of c to st
+void cache_stats(struct plus_cache *c, struct plus_cache_stats *st);
+// Cache to read level lvl through, if any, and the id to use with it
+struct plus_cache *level_cache(struct plus_image *img, int lvl, int *id);
+
+// Write-back staging of partial writes, see plus-wb.c
+
+// Stage a write of nv buffers to cluster idx, which is not in the top
+// delta, but in block blk of some level below, or is a hole if blk is 0.
+// Called with the write gate and the cluster lock held. Returns 1 if
+// staged, 0 if the caller has to write it itself, or -errno.
+int wb_write(struct plus_image *img, u32 idx, u32 blk, u32 off, u32 len,
+		const struct iovec *v, int nv, bool zero);
+// Write out the staged data of cluster idx, if any. Called with the
+// write gate (or it frozen) and the cluster lock held.
+int wb_writeout(struct plus_image *img, u32 idx);
+// Write out everything staged so far. Called with the write gate held,
+// or frozen.
+int wb_flush(struct plus_image *img);
+// Changes once staged data is written out
+u32 wb_seq(struct plus_image *img);
+// Check if any of n clusters from idx on have data staged
+bool wb_staged(struct plus_image *img, u32 idx, u32 n);
+// Put the staged data for [offset, offset + len) over buf
+void wb_overlay(struct plus_image *img, off_t offset, size_t len, void *buf);
+// Write out everything, and free the staging buffers
+int wb_free(struct plus_image *img);
+
+// Readahead, see plus-ra.c
+
+// Note a read of the image, called by plus_read()
+void ra_read(struct plus_image *img, off_t offset, size_t size);
+// Drop queued readahead and wait for what is being read
+void ra_drain(struct plus_image *img);
+void ra_free(struct plus_image *img);
+
+// Mapped read-only deltas, see plus-mmap.c
+
+void mmap_free(struct plus_image *img);
+// Pointer to len bytes at pos of level lvl, or NULL if not mapped
+const void *mmap_ptr(struct plus_image *img, int lvl, off_t pos, size_t len);
+
+// Shared read-only deltas, see plus-host.c
+
+struct shared_delta {
+	struct shared_delta *next;
+	dev_t dev;
+	ino_t ino;
+	int refs;
+	int fd;
+	u32 *bat;	// mmap()'ed BAT, including the header
+	u32 clusterSize;
+	u32 batSize;	// in clusters
+	u32 bdevSize;	// in clusters
+	u32 allocSize;	// in clusters
+	struct plus_cache *cache; // shared by all the images, can be NULL
+};
+
+int host_mode(void);
+// Find a shared delta by its inode, and take a reference to it
+struct shared_delta *host_get(const struct stat *st);
+// Share a newly opened delta. If someone else has done it already,
+// their delta is returned instead, and the caller must drop theirs.
+struct shared_delta *host_add(const struct stat *st, int fd, u32 *bat,
+		u32 clusterSize, u32 batSize, u32 bdevSize, u32 allocSize);
+// Drop a reference, closing the delta once it's no longer used
+void host_put(struct shared_delta *sd);
+
+#endif // _PLUS_INT_H_
@@ -0,0 +1,490 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "plus.h"
+#include "plus-int.h"
+
+// The combined map: which level and block each cluster lives in.
+//
+// Clusters are grouped into chunks of MAP_CHUNK. Each chunk is stored
+// either as a sorted array of extents (runs of clusters that are
+// contiguous in the same delta), or, once it gets too fragmented for
+// that to be a win, as a dense array of (block, level) entries, one per
+// cluster. Empty chunks take no memory besides the chunk table, so
+// sparse images only pay for what is allocated.
+//
+// Readers take no locks. Writers are serialized by img->map_lock, and
+// bump a per-chunk sequence count around each change, so readers can
+// detect it and retry (like the kernel's seqlock). Since readers might
+// still be looking at an extent array while it is being replaced, old
+// arrays are kept around until map_free(). Arrays only grow by doubling,
+// so this at most doubles the memory used by extents.
+
+// A run of clusters [start, start + len) of a chunk,
+// stored in blocks [blk, blk + len) of level lvl
+struct map_ext {
+	u32 blk;
+	u16 start;
+	u16 len;
+	u8  lvl;
+};
+
+// Dense map entry; blk of 0 means a hole
+struct map_ent {
+	u32 blk;
+	u8  lvl;
+} __attribute__((packed));
+
+enum {
+	MAP_EXTENTS,
+	MAP_DENSE,
+};
+
+struct map_chunk {
+	u32 seq;	// odd while the chunk is being changed
+	u8  type;
+	u16 n;		// number of extents
+	u16 cap;	// number of extents allocated
+	union {
+		struct map_ext *ext;
+		struct map_ent *ent;
+	};
+};
+
+// An array replaced by map_set(), to be freed by map_free()
+struct map_retired {
+	struct map_retired *next;
+	void *ptr;
+};
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+// Max number of extents in a chunk, before it's converted to dense.
+// Let's keep extents no bigger than a dense chunk, and inserts cheap.
+#define MAP_MAX_EXTENTS	MIN(MAP_CHUNK * sizeof(struct map_ent) / \
+		sizeof(struct map_ext), 512)
+
+int map_init(struct plus_image *img)
+{
+	img->nchunks = (img->bdevSize + MAP_CHUNK - 1) / MAP_CHUNK;
+	img->map = calloc(img->nchunks, sizeof(*img->map));
+	if (!img->map) {
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void map_free(struct plus_image *img)
+{
+	if (!img->map) {
+		return;
+	}
+
+	for (u32 c = 0; c < img->nchunks; c++) {
+		// ext and ent share the pointer
+		free(img->map[c].ext);
+	}
+	free(img->map);
+	img->map = NULL;
+
+	struct map_retired *r = img->retired;
+	while (r) {
+		struct map_retired *next = r->next;
+		free(r->ptr);
+		free(r);
+		r = next;
+	}
+	img->retired = NULL;
+}
+
+size_t map_mem(struct plus_image *img)
+{
+	size_t mem = img->nchunks * sizeof(*img->map);
+
+	for (u32 c = 0; c < img->nchunks; c++) {
+		struct map_chunk *ch = &img->map[c];
+		if (ch->type == MAP_DENSE) {
+			mem += MAP_CHUNK * sizeof(*ch->ent);
+		} else {
+			mem += ch->cap * sizeof(*ch->ext);
+		}
+	}
+
+	return mem;
+}
+
+// Find the first of n extents that ends after i
+static int find_ext(struct map_ext *ext, int n, u32 i)
+{
+	int lo = 0, hi = n;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		struct map_ext *e = &ext[mid];
+		if ((u32)e->start + e->len <= i) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+// Look up cluster i of a chunk, return the number of clusters, up to max,
+// mapped the same way. Might see the chunk in the middle of a change, in
+// which case the result is garbage, but we must not crash. For that,
+// the fields are read in the order map_set() changes them in.
+static u32 chunk_run(struct map_chunk *ch, u32 i, u32 max, int *lvl, u32 *blk)
+{
+	u8 type = LOAD(ch->type);
+	int n = LOAD(ch->n);
+	struct map_ext *ext = LOAD(ch->ext);
+	u32 cnt;
+
+	*lvl = 0;
+	*blk = 0;
+	if (type == MAP_DENSE) {
+		struct map_ent *e = &((struct map_ent *)ext)[i];
+		u32 b = e->blk;
+		int l = e->lvl;
+		for (cnt = 1; cnt < max; cnt++) {
+			if (b ? (e[cnt].blk != b + cnt || e[cnt].lvl != l) :
+					e[cnt].blk != 0) {
+				break;
+			}
+		}
+		*lvl = l;
+		*blk = b;
+		return cnt;
+	}
+
+	int k = find_ext(ext, n, i);
+	struct map_ext *e = &ext[k];
+	if (k < n && e->start <= i) {
+		*blk = e->blk + (i - e->start);
+		*lvl = e->lvl;
+		cnt = e->start + e->len - i;
+	} else {
+		// hole, up to the next extent
+		cnt = (k < n ? e->start : MAP_CHUNK) - i;
+	}
+
+	return MIN(cnt, max);
+}
+
+u32 map_run(struct plus_image *img, u32 idx, u32 max, int *lvl, u32 *blk)
+{
+	if (max > img->bdevSize - idx) {
+		max = img->bdevSize - idx;
+	}
+
+	u32 n = 0;
+	*lvl = 0;
+	*blk = 0;
+	while (n < max) {
+		u32 cur = idx + n;
+		struct map_chunk *ch = &img->map[cur / MAP_CHUNK];
+		u32 i = cur % MAP_CHUNK;
+		u32 left = MIN(MAP_CHUNK - i, max - n); // left in this chunk
+		int l;
+		u32 b, cnt, seq;
+
+		do {
+			seq = LOAD(ch->seq);
+			if (seq & 1) {
+				continue; // being changed right now
+			}
+			cnt = chunk_run(ch, i, left, &l, &b);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while ((seq & 1) || __atomic_load_n(&ch->seq,
+					__ATOMIC_RELAXED) != seq);
+
+		if (n == 0) {
+			*lvl = l;
+			*blk = b;
+		} else if (*blk ? (b != *blk + n || l != *lvl) : b != 0) {
+			break;
+		}
+		n += cnt;
+	}
+
+	return n;
+}
+
+void map_get(struct plus_image *img, u32 idx, int *lvl, u32 *blk)
+{
+	map_run(img, idx, 1, lvl, blk);
+}
+
+// Keep ptr until map_free()
+static void retire(struct plus_image *img, struct map_retired *r, void *ptr)
+{
+	r->ptr = ptr;
+	r->next = img->retired;
+	img->retired = r;
+}
+
+void map_retire(struct plus_image *img, void *ptr)
+{
+	struct map_retired *r = malloc(sizeof(*r));
+	if (!r) {
+		// can't keep track of it, so just leave it be
+		return;
+	}
+
+	pthread_mutex_lock(&img->map_lock);
+	retire(img, r, ptr);
+	pthread_mutex_unlock(&img->map_lock);
+}
+
+static int to_dense(struct plus_image *img, struct map_chunk *ch)
+{
+	struct map_ent *ent = calloc(MAP_CHUNK, sizeof(*ent));
+	if (!ent) {
+		return -ENOMEM;
+	}
+
+	struct map_retired *r = malloc(sizeof(*r));
+	if (!r) {
+		free(ent);
+		return -ENOMEM;
+	}
+
+	for (int k = 0; k < ch->n; k++) {
+		struct map_ext *e = &ch->ext[k];
+		for (u32 j = 0; j < e->len; j++) {
+			ent[e->start + j].blk = e->blk + j;
+			ent[e->start + j].lvl = e->lvl;
+		}
+	}
+	retire(img, r, ch->ext);
+	// a dense array is never smaller than an extent one,
+	// so it is safe to switch the pointer first
+	STORE(ch->ent, ent);
+	STORE(ch->type, MAP_DENSE);
+	ch->cap = 0;
+
+	return 0;
+}
+
+// Make room for one more extent at position k
+static int ext_insert(struct plus_image *img, struct map_chunk *ch, int k)
+{
+	if (ch->n == ch->cap) {
+		u32 cap = ch->cap ? ch->cap * 2 : 4;
+		struct map_ext *ext = malloc(cap * sizeof(*ext));
+		struct map_retired *r = ch->ext ? malloc(sizeof(*r)) : NULL;
+		if (!ext || (ch->ext && !r)) {
+			free(ext);
+			free(r);
+			return -ENOMEM;
+		}
+		if (ch->ext) {
+			memcpy(ext, ch->ext, ch->n * sizeof(*ext));
+			retire(img, r, ch->ext);
+		}
+		STORE(ch->ext, ext);
+		ch->cap = cap;
+	}
+	memmove(&ch->ext[k + 1], &ch->ext[k], (ch->n - k) * sizeof(*ch->ext));
+	STORE(ch->n, ch->n + 1);
+
+	return 0;
+}
+
+static void ext_remove(struct map_chunk *ch, int k)
+{
+	STORE(ch->n, ch->n - 1);
+	memmove(&ch->ext[k], &ch->ext[k + 1], (ch->n - k) * sizeof(*ch->ext));
+}
+
+// Can extent b be appended to extent a?
+static inline int ext_adjacent(struct map_ext *a, struct map_ext *b)
+{
+	return a->lvl == b->lvl && a->start + a->len == b->start &&
+		a->blk + a->len == b->blk;
+}
+
+static int chunk_set(struct plus_image *img, struct map_chunk *ch, u32 i,
+		int lvl, u32 blk)
+{
+	if (ch->type == MAP_DENSE) {
+		ch->ent[i].blk = blk;
+		ch->ent[i].lvl = blk ? lvl : 0;
+		return 0;
+	}
+
+	if ((size_t)ch->n + 2 > MAP_MAX_EXTENTS) {
+		// too fragmented (and we might need two more)
+		int ret = to_dense(img, ch);
+		if (ret) {
+			return ret;
+		}
+		return chunk_set(img, ch, i, lvl, blk);
+	}
+
+	// Cut i out of the extent covering it, if any
+	int k = find_ext(ch->ext, ch->n, i);
+	struct map_ext *e = &ch->ext[k];
+	if (k < ch->n && e->start <= i) {
+		u32 end = e->start + e->len;
+		if (e->len == 1) {
+			ext_remove(ch, k);
+		} else if (i == e->start) {
+			e->start++;
+			e->blk++;
+			e->len--;
+		} else if (i == end - 1) {
+			e->len--;
+			k++;
+		} else {
+			// split in two
+			if (ext_insert(img, ch, k + 1)) {
+				return -ENOMEM;
+			}
+			e = &ch->ext[k];
+			struct map_ext *r = &ch->ext[k + 1];
+			*r = *e;
+			r->start = i + 1;
+			r->blk = e->blk + (i + 1 - e->start);
+			r->len = end - (i + 1);
+			e->len = i - e->start;
+			k++;
+		}
+	}
+	if (!blk) {
+		// a hole, we're done
+		return 0;
+	}
+
+	// Insert the new one at k, merging with the neighbours if possible
+	struct map_ext new = { .blk = blk, .start = i, .len = 1, .lvl = lvl };
+	struct map_ext *prev = k > 0 ? &ch->ext[k - 1] : NULL;
+	struct map_ext *next = k < ch->n ? &ch->ext[k] : NULL;
+	if (prev && ext_adjacent(prev, &new)) {
+		prev->len++;
+		if (next && ext_adjacent(prev, next)) {
+			prev->len += next->len;
+			ext_remove(ch, k);
+		}
+	} else if (next && ext_adjacent(&new, next)) {
+		next->start--;
+		next->blk--;
+		next->len++;
+	} else {
+		if (ext_insert(img, ch, k)) {
+			return -ENOMEM;
+		}
+		ch->ext[k] = new;
+	}
+
+	return 0;
+}
+
+// Called with map_lock held
+static int set_locked(struct plus_image *img, u32 idx, int lvl, u32 blk)
+{
+	struct map_chunk *ch = &img->map[idx / MAP_CHUNK];
+
+	u32 seq = ch->seq;
+	__atomic_store_n(&ch->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	int ret = chunk_set(img, ch, idx % MAP_CHUNK, lvl, blk);
+
+	STORE(ch->seq, seq + 2);
+
+	return ret;
+}
+
+int map_set(struct plus_image *img, u32 idx, int lvl, u32 blk)
+{
+	pthread_mutex_lock(&img->map_lock);
+	int ret = set_locked(img, idx, lvl, blk);
+	pthread_mutex_unlock(&img->map_lock);
+
+	return ret;
+}
+
+int map_replace(struct plus_image *img, u32 idx, int olvl, u32 oblk,
+		int lvl, u32 blk)
+{
+	int ret = 0;
+	int l;
+	u32 b;
+
+	pthread_mutex_lock(&img->map_lock);
+	// no writers but us, so this is stable
+	map_get(img, idx, &l, &b);
+	if (l == olvl && b == oblk) {
+		ret = set_locked(img, idx, lvl, blk);
+	}
+	pthread_mutex_unlock(&img->map_lock);
+
+	return ret;
+}
+
+int map_build_chunk(struct plus_image *img, u32 c, const u8 *lvl,
+		const u32 *blk)
+{
+	struct map_chunk *ch = &img->map[c];
+	u32 len = MIN(MAP_CHUNK, img->bdevSize - c * MAP_CHUNK);
+
+	// Count the extents first
+	u32 n = 0;
+	for (u32 i = 0; i < len; i++) {
+		if (blk[i] && (i == 0 || !blk[i - 1] ||
+					blk[i] != blk[i - 1] + 1 ||
+					lvl[i] != lvl[i - 1])) {
+			n++;
+		}
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	if (n > MAP_MAX_EXTENTS) {
+		ch->ent = malloc(MAP_CHUNK * sizeof(*ch->ent));
+		if (!ch->ent) {
+			return -ENOMEM;
+		}
+		ch->type = MAP_DENSE;
+		for (u32 i = 0; i < MAP_CHUNK; i++) {
+			ch->ent[i].blk = i < len ? blk[i] : 0;
+			ch->ent[i].lvl = i < len ? lvl[i] : 0;
+		}
+		return 0;
+	}
+
+	ch->ext = malloc(n * sizeof(*ch->ext));
+	if (!ch->ext) {
+		return -ENOMEM;
+	}
+	ch->type = MAP_EXTENTS;
+	ch->cap = n;
+	ch->n = 0;
+	for (u32 i = 0; i < len; i++) {
+		if (!blk[i]) {
+			continue;
+		}
+		struct map_ext *e = ch->n ? &ch->ext[ch->n - 1] : NULL;
+		if (e && e->start + e->len == i && e->blk + e->len == blk[i] &&
+				e->lvl == lvl[i]) {
+			e->len++;
+		} else {
+			e = &ch->ext[ch->n++];
+			e->start = i;
+			e->len = 1;
+			e->blk = blk[i];
+			e->lvl = lvl[i];
+		}
+	}
+
+	return 0;
+}
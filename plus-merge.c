@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/types.h>
+
+#include <ploop/ploop_if.h>
+#include <ploop/ploop1_image.h>
+
+#include "plus.h"
+#include "plus-int.h"
+#include "plus-trace.h"
+
+// Online merge of a delta into the one below it, like "ploop merge".
+//
+// All the clusters allocated in the delta are copied into the lower one,
+// either over the lower delta's own copy of the cluster, or to new space
+// at its end. This is done in runs of adjacent clusters, by a number of
+// threads at once. Once all the data are synced, the lower delta's BAT
+// is updated, and the merged delta is no longer needed on disk.
+//
+// It all happens while the image is in use. The merged delta itself is
+// not changed, so reading from it is fine all along, and the combined
+// map is switched over to the lower delta cluster by cluster once the
+// data are there, leaving alone those rewritten in upper levels in the
+// meantime. As readers take no locks, they might still be reading from
+// the merged delta after that, so it is only closed by plus_close(),
+// and the levels are not renumbered.
+//
+// If anything fails, or we crash, the delta chain on disk is still good,
+// as whatever was copied into the lower delta is overridden by the
+// merged one.
+
+// Max size of a single copy, in bytes
+#define MERGE_RUN_SIZE		(16U << 20)
+#define MERGE_MAX_THREADS	8
+
+// A run of clusters, adjacent in both deltas
+struct merge_run {
+	u32 idx;	// first cluster number
+	u32 src;	// first block in the merged delta
+	u32 dst;	// first block in the lower delta
+	u32 n;		// number of clusters
+};
+
+struct merge {
+	struct plus_image *img;
+	int level;		// delta being merged
+	int lower;		// delta it is merged into
+	int fd;			// lower delta, opened for writing
+	struct merge_run *runs;
+	u32 nruns;
+	u32 next;		// next run to copy
+	int ret;
+};
+
+// Map BAT of a delta, including the header. Returns NULL on error.
+static u32 *map_bat(struct plus_image *img, int fd, int prot, u32 *batSize)
+{
+	u32 cluster = img->clusterSize;
+
+	// The header is in the first cluster, which is always part of BAT
+	struct ploop_pvd_header *pvd = mmap(NULL, cluster, PROT_READ,
+			MAP_SHARED, fd, 0);
+	if (pvd == MAP_FAILED) {
+		fprintf(stderr, "%s: can't mmap: %m\n", __func__);
+		return NULL;
+	}
+	*batSize = pvd->m_FirstBlockOffset >> (ffs(pvd->m_Sectors) - 1);
+	munmap(pvd, cluster);
+
+	u32 *bat = mmap(NULL, (size_t)*batSize * cluster, prot,
+			MAP_SHARED, fd, 0);
+	if (bat == MAP_FAILED) {
+		fprintf(stderr, "%s: can't mmap: %m\n", __func__);
+		return NULL;
+	}
+
+	return bat;
+}
+
+// Walk through the merged delta's BAT, and figure out what goes where.
+// Clusters the lower delta doesn't have are allocated past *alloc.
+static int plan_runs(struct merge *m, const u32 *sbat, u32 sbatSize,
+		const u32 *dbat, u32 dbatSize, u32 *alloc)
+{
+	u32 cluster = m->img->clusterSize;
+	u32 smax = sbatSize * (cluster / 4) - HDR_SIZE_32;
+	u32 dmax = dbatSize * (cluster / 4) - HDR_SIZE_32;
+	u32 max_run = MAX(MERGE_RUN_SIZE / cluster, 1);
+	u32 size = 0;
+
+	for (u32 idx = 0; idx < smax; idx++) {
+		u32 src = sbat[HDR_SIZE_32 + idx];
+		if (!src) {
+			continue;
+		}
+		if (idx >= dmax) {
+			fprintf(stderr, "%s: cluster %u doesn't fit "
+					"into lower delta BAT\n", __func__, idx);
+			return -E2BIG;
+		}
+		u32 dst = dbat[HDR_SIZE_32 + idx];
+		if (!dst) {
+			dst = (*alloc)++;
+		}
+
+		struct merge_run *r = m->nruns ? &m->runs[m->nruns - 1] : NULL;
+		if (r && r->n < max_run && r->idx + r->n == idx &&
+				r->src + r->n == src && r->dst + r->n == dst) {
+			r->n++;
+			continue;
+		}
+		if (m->nruns == size) {
+			size = size ? size * 2 : 64;
+			r = realloc(m->runs, size * sizeof(*r));
+			if (!r) {
+				return -ENOMEM;
+			}
+			m->runs = r;
+		}
+		r = &m->runs[m->nruns++];
+		r->idx = idx;
+		r->src = src;
+		r->dst = dst;
+		r->n = 1;
+	}
+
+	return 0;
+}
+
+static void *copy_runs(void *data)
+{
+	struct merge *m = data;
+	struct plus_image *img = m->img;
+	u32 cluster = img->clusterSize;
+	u32 i;
+
+	while ((i = __atomic_fetch_add(&m->next, 1, __ATOMIC_RELAXED)) <
+			m->nruns) {
+		if (__atomic_load_n(&m->ret, __ATOMIC_RELAXED)) {
+			break;
+		}
+		struct merge_run *r = &m->runs[i];
+		TRACE(TR_MERGE, m->lower, r->idx, r->dst, 0, r->n);
+		int ret = fill_range(img, img->fds[m->level],
+				(off_t)r->src * cluster, m->fd,
+				(off_t)r->dst * cluster, (size_t)r->n * cluster);
+		if (ret) {
+			__atomic_store_n(&m->ret, ret, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+// Copy all the runs, in parallel
+static int copy_all(struct merge *m)
+{
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = MIN(nthreads, MERGE_MAX_THREADS);
+	nthreads = MIN(nthreads, m->nruns);
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+
+	pthread_t threads[MERGE_MAX_THREADS];
+	long started = 0;
+	for (long t = 0; t < nthreads - 1; t++) {
+		if (pthread_create(&threads[t], NULL, copy_runs, m)) {
+			// the rest will do
+			break;
+		}
+		started++;
+	}
+	copy_runs(m);
+	for (long t = 0; t < started; t++) {
+		pthread_join(threads[t], NULL);
+	}
+
+	return m->ret;
+}
+
+// Grow the lower delta from old to new clusters
+static int grow(struct plus_image *img, int fd, u32 old, u32 new)
+{
+	u32 cluster = img->clusterSize;
+
+	if (new == old) {
+		return 0;
+	}
+	if (!fallocate(fd, 0, (off_t)old * cluster,
+				(off_t)(new - old) * cluster)) {
+		return 0;
+	}
+	if (errno == EOPNOTSUPP && !ftruncate(fd, (off_t)new * cluster)) {
+		return 0;
+	}
+	fprintf(stderr, "%s: can't grow delta: %m\n", __func__);
+	return -errno;
+}
+
+int plus_merge(struct plus_image *img, int level)
+{
+	if (!img) {
+		return -EBADF;
+	}
+	if (img->mode == O_RDONLY) {
+		return -EROFS;
+	}
+	// The top delta is being written to, so can't be merged
+	if (level < 1 || level >= img->level || img->merged[level]) {
+		fprintf(stderr, "%s: can't merge level %d\n", __func__, level);
+		return -EINVAL;
+	}
+	if (pthread_mutex_trylock(&img->level_lock)) {
+		return -EBUSY;
+	}
+
+	u32 cluster = img->clusterSize;
+	struct merge m = {
+		.img = img,
+		.level = level,
+		.fd = -1,
+	};
+	u32 *sbat = NULL, *dbat = NULL;
+	u32 sbatSize = 0, dbatSize = 0;
+	int ret;
+
+	// Level 0 is never merged, so there always is one
+	int lower = level - 1;
+	while (img->merged[lower]) {
+		lower--;
+	}
+	m.lower = lower;
+	if (img->shared[lower]) {
+		fprintf(stderr, "%s: level %d is shared with other images\n",
+				__func__, lower);
+		ret = -EBUSY;
+		goto out;
+	}
+
+	// The lower delta was opened read-only, reopen it
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", img->fds[lower]);
+	m.fd = open(path, O_RDWR | O_DIRECT);
+	if (m.fd < 0) {
+		fprintf(stderr, "%s: can't reopen level %d: %m\n",
+				__func__, lower);
+		ret = -errno;
+		goto out;
+	}
+	struct stat st;
+	if (fstat(m.fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+	u32 old = (st.st_size + cluster - 1) / cluster;
+	u32 alloc = old;
+
+	sbat = map_bat(img, img->fds[level], PROT_READ, &sbatSize);
+	dbat = map_bat(img, m.fd, PROT_READ | PROT_WRITE, &dbatSize);
+	if (!sbat || !dbat) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	madvise(sbat, (size_t)sbatSize * cluster, MADV_SEQUENTIAL);
+
+	ret = plan_runs(&m, sbat, sbatSize, dbat, dbatSize, &alloc);
+	if (ret) {
+		goto out;
+	}
+	printf("Merging level %d into %d: %u runs, %u new clusters\n",
+			level, lower, m.nruns, alloc - old);
+
+	ret = grow(img, m.fd, old, alloc);
+	if (ret) {
+		goto out;
+	}
+	mark_in_use(dbat, true);
+
+	ret = copy_all(&m);
+	if (!ret && fdatasync(m.fd)) {
+		fprintf(stderr, "%s: fdatasync: %m\n", __func__);
+		ret = -errno;
+	}
+	if (ret) {
+		// nothing refers to the new space yet
+		if (ftruncate(m.fd, (off_t)old * cluster)) {
+			fprintf(stderr, "%s: ftruncate: %m\n", __func__);
+		}
+		mark_in_use(dbat, false);
+		goto out;
+	}
+
+	// Now that the data are there, update BAT of the lower delta
+	for (u32 i = 0; i < m.nruns; i++) {
+		struct merge_run *r = &m.runs[i];
+		for (u32 j = 0; j < r->n; j++) {
+			dbat[HDR_SIZE_32 + r->idx + j] = r->dst + j;
+			// it might have had that cluster cached
+			cache_invalidate(img->cache, lower, r->dst + j);
+		}
+	}
+	struct ploop_pvd_header *spvd = (struct ploop_pvd_header *)sbat;
+	struct ploop_pvd_header *dpvd = (struct ploop_pvd_header *)dbat;
+	if (dpvd->m_SizeInSectors_v2 < spvd->m_SizeInSectors_v2) {
+		dpvd->m_SizeInSectors_v2 = spvd->m_SizeInSectors_v2;
+	}
+	if (msync(dbat, (size_t)dbatSize * cluster, MS_SYNC)) {
+		fprintf(stderr, "%s: msync: %m\n", __func__);
+		ret = -errno;
+		goto out;
+	}
+	mark_in_use(dbat, false);
+
+	// Switch the map over, unless the cluster was rewritten since
+	for (u32 i = 0; i < m.nruns; i++) {
+		struct merge_run *r = &m.runs[i];
+		for (u32 j = 0; j < r->n && r->idx + j < img->bdevSize; j++) {
+			// on failure, it keeps pointing to the merged delta,
+			// which is still fine
+			map_replace(img, r->idx + j, level, r->src + j,
+					lower, r->dst + j);
+		}
+	}
+	img->merged[level] = 1;
+
+out:
+	if (sbat) {
+		munmap(sbat, (size_t)sbatSize * cluster);
+	}
+	if (dbat) {
+		munmap(dbat, (size_t)dbatSize * cluster);
+	}
+	if (m.fd >= 0) {
+		close(m.fd);
+	}
+	free(m.runs);
+	pthread_mutex_unlock(&img->level_lock);
+
+	return ret;
+}
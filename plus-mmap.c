@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "plus.h"
+#include "plus-int.h"
+#include "plus-trace.h"
+
+// Memory-mapped read-only deltas.
+//
+// Lower deltas don't change while the image is open, yet, as they are
+// opened with O_DIRECT, every read of them goes to the disk. Instead,
+// they can be mapped into memory once, and read via the page cache:
+// plus_read() then copies the data from the mapping without a syscall,
+// and plus_read_map() does not copy it at all, but points the caller
+// right at it.
+//
+// Mappings are advised MADV_RANDOM, as images are mostly read a cluster
+// here and there, so the kernel readahead would mostly bring in clusters
+// belonging to other parts of the image. Once the reads of a delta are
+// seen to be sequential, the kernel is asked to read ahead explicitly,
+// with MADV_WILLNEED.
+
+// How much to read ahead, in bytes
+#define MMAP_READAHEAD	(1U << 20)
+
+struct delta_mmap {
+	void *addr;	// NULL if not mapped
+	off_t size;	// file size
+	off_t next;	// where the last read ended
+	off_t ra;	// readahead was requested up to here
+};
+
+struct plus_mmap {
+	void *zero;	// MAX_IO_SIZE bytes of zeroes, for holes
+	int nlevels;	// levels there were at setup, see plus_snapshot()
+	struct delta_mmap lv[];	// per level
+};
+
+void mmap_free(struct plus_image *img)
+{
+	struct plus_mmap *m = img->mmap;
+
+	if (!m) {
+		return;
+	}
+
+	for (int l = 0; l < m->nlevels; l++) {
+		if (m->lv[l].addr) {
+			munmap(m->lv[l].addr, m->lv[l].size);
+		}
+	}
+	if (m->zero) {
+		munmap(m->zero, MAX_IO_SIZE);
+	}
+	free(m);
+	img->mmap = NULL;
+}
+
+int plus_mmap_setup(struct plus_image *img, int on)
+{
+	if (!img) {
+		return -EBADF;
+	}
+
+	ra_drain(img);
+	mmap_free(img);
+	if (!on) {
+		return 0;
+	}
+
+	struct plus_mmap *m = calloc(1, sizeof(*m) +
+			img->max_levels * sizeof(m->lv[0]));
+	if (!m) {
+		return -ENOMEM;
+	}
+	img->mmap = m;
+	m->nlevels = img->max_levels;
+
+	// This costs nothing but address space, as all the pages
+	// are backed by the same zero page
+	m->zero = mmap(NULL, MAX_IO_SIZE, PROT_READ,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m->zero == MAP_FAILED) {
+		m->zero = NULL;
+		goto err;
+	}
+
+	// The top delta can only be mapped if it is not written to
+	int top = img->mode == O_RDONLY ? img->level : img->level - 1;
+	for (int l = 0; l <= top; l++) {
+		struct delta_mmap *d = &m->lv[l];
+		struct stat st;
+
+		if (fstat(img->fds[l], &st)) {
+			goto err;
+		}
+		if (st.st_size == 0) {
+			continue;
+		}
+		d->addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+				img->fds[l], 0);
+		if (d->addr == MAP_FAILED) {
+			d->addr = NULL;
+			goto err;
+		}
+		d->size = st.st_size;
+		madvise(d->addr, d->size, MADV_RANDOM);
+	}
+
+	return 0;
+
+err:
+	fprintf(stderr, "%s: can't mmap: %m\n", __func__);
+	int ret = -errno;
+	mmap_free(img);
+	return ret;
+}
+
+const void *mmap_ptr(struct plus_image *img, int lvl, off_t pos, size_t len)
+{
+	if (lvl >= img->mmap->nlevels) {
+		return NULL;
+	}
+
+	struct delta_mmap *d = &img->mmap->lv[lvl];
+	if (!d->addr || pos + (off_t)len > d->size) {
+		return NULL;
+	}
+
+	// These are just hints, so no locking, only avoid torn values
+	off_t end = pos + len;
+	off_t next = __atomic_exchange_n(&d->next, end, __ATOMIC_RELAXED);
+	if (pos == next) {
+		// Sequential; ask for more once half of the window is used
+		off_t ra = __atomic_load_n(&d->ra, __ATOMIC_RELAXED);
+		if (end + MMAP_READAHEAD / 2 > ra && end < d->size) {
+			off_t from = MAX(ra, end) & ~(off_t)(PAGE_SIZE - 1);
+			off_t to = MIN(end + MMAP_READAHEAD, d->size);
+			__atomic_store_n(&d->ra, to, __ATOMIC_RELAXED);
+			madvise(d->addr + from, to - from, MADV_WILLNEED);
+		}
+	}
+
+	return d->addr + pos;
+}
+
+ssize_t plus_read_map(struct plus_image *img, size_t size, off_t offset,
+		struct iovec *iov, int *niov)
+{
+	// No need for alignment, it's all memory
+	int ret = range_checks(__func__, img, size, offset);
+	if (ret) {
+		return ret;
+	}
+	if (!img->mmap) {
+		return -EINVAL;
+	}
+	TRACE(TR_READ, 0, offset / img->clusterSize, 0,
+			offset % img->clusterSize, size);
+
+	u32 cluster = img->clusterSize;
+	size_t got = 0;
+	int n = 0;
+
+	while (got < size && n < *niov) {
+		u32 idx = offset / cluster;
+		u32 off = offset % cluster;
+		u32 want = (off + MIN(size - got, MAX_IO_SIZE) + cluster - 1) / cluster;
+		int lvl;
+		u32 blk;
+		u32 seq = img->wb ? wb_seq(img) : 0;
+		u32 run = map_run(img, idx, want, &lvl, &blk);
+		size_t len = MIN((size_t)run * cluster - off, size - got);
+
+		TRACE(TR_RUN, lvl, idx, blk, off, len);
+		const void *p;
+		if (blk) {
+			p = mmap_ptr(img, lvl, (off_t)blk * cluster + off, len);
+			if (!p) {
+				// not mapped, the caller has to read it
+				break;
+			}
+		} else {
+			len = MIN(len, MAX_IO_SIZE);
+			p = img->mmap->zero;
+		}
+		if (img->wb && (wb_staged(img, idx, run) ||
+					wb_seq(img) != seq)) {
+			// staged writes, or some were written out meanwhile
+			break;
+		}
+
+		struct iovec *prev = n ? &iov[n - 1] : NULL;
+		if (prev && prev->iov_base + prev->iov_len == p) {
+			prev->iov_len += len;
+		} else {
+			iov[n].iov_base = (void *)p;
+			iov[n].iov_len = len;
+			n++;
+		}
+		got += len;
+		offset += len;
+	}
+	*niov = n;
+
+	return got;
+}
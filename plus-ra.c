@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "plus.h"
+#include "plus-int.h"
+#include "plus-trace.h"
+
+// Readahead.
+//
+// The deltas are opened with O_DIRECT, so there is no readahead by the
+// kernel, and a sequential read of the image waits for the disk on
+// every cluster. Instead, plus_read() requests are matched against
+// a few streams of reads per image, which are either sequential (each
+// read starts around where the previous ones ended, allowing for reads
+// done by many threads at once coming out of order), or strided (each
+// read starts a fixed distance after the previous one). Once a read
+// follows a stream, what the stream is going to read next is queued,
+// and read into the cluster cache by a pool of threads, through the
+// combined map, so adjacent clusters are read with a single preadv().
+//
+// Like with the kernel readahead, the window starts small, and doubles
+// every time the next one is queued, which is once half of the current
+// window has been read, so that the threads stay ahead of the reader.
+// If a stream is dropped (replaced by a new one) before it reads most
+// of what was read ahead for it, the max window for the image is
+// halved; it doubles back once the streams grow up to it again.
+
+#define RA_STREAMS	8		// streams tracked per image
+#define RA_QUEUE	64		// queued readahead requests
+#define RA_MIN		(256U << 10)	// initial window, in bytes
+#define RA_SLACK	(1U << 20)	// out of order reads still sequential
+#define RA_MAX_STRIDE	(64U << 20)	// reads further apart are unrelated
+#define RA_MAX_REQ	(8U << 20)	// adjacent requests are merged up to this
+
+struct ra_stream {
+	u64 used;	// when it last matched a read, 0 if not in use
+	off_t last;	// start of the last read
+	off_t end;	// where the reads have got to
+	off_t stride;	// between starts of the reads, 0 if sequential
+	size_t len;	// size of the last read
+	off_t ra;	// end of what is queued, or for strided streams,
+			// the start of the next read to queue
+	size_t window;	// how much to keep queued ahead, in bytes
+	u32 hits;	// reads that followed the stream
+};
+
+struct ra_req {
+	off_t offset;
+	size_t len;
+};
+
+struct plus_ra {
+	struct plus_image *img;
+	off_t size;		// image size
+
+	pthread_mutex_t lock;	// streams, and the windows
+	struct ra_stream streams[RA_STREAMS];
+	u64 clock;
+	size_t min, max;	// window limits
+	size_t cap;		// current max window
+
+	pthread_mutex_t qlock;	// the queue, and the threads
+	pthread_cond_t work;	// something is queued, or stop is set
+	pthread_cond_t idle;	// nothing is queued or being read
+	struct ra_req q[RA_QUEUE];
+	u32 qhead, qlen;
+	u32 busy;		// threads reading
+	bool stop;
+
+	int nthreads;
+	pthread_t threads[];
+};
+
+// Read [offset, offset + len) into the caches of the levels it is in
+static void fetch(struct plus_image *img, off_t offset, size_t len)
+{
+	u32 cluster = img->clusterSize;
+	u32 idx = offset / cluster;
+	u32 last = (offset + len + cluster - 1) / cluster;
+	u32 epoch = read_begin(img);
+
+	while (idx < last) {
+		u32 want = MIN(last - idx, MAX_IO_SIZE / cluster);
+		int lvl;
+		u32 blk;
+		u32 n = map_run(img, idx, want, &lvl, &blk);
+		off_t pos = (off_t)blk * cluster;
+		int id;
+		struct plus_cache *c = blk ? level_cache(img, lvl, &id) : NULL;
+
+		// Whatever fails here, plus_read() will find out for itself
+		if (c && !(img->mmap && mmap_ptr(img, lvl, pos,
+						(size_t)n * cluster))) {
+			cache_prefetch(c, id, img->fds[lvl], blk, n);
+		}
+		idx += n;
+	}
+	read_end(img, epoch);
+}
+
+static void *ra_thread(void *arg)
+{
+	struct plus_ra *ra = arg;
+
+	pthread_mutex_lock(&ra->qlock);
+	for (;;) {
+		while (!ra->qlen && !ra->stop) {
+			pthread_cond_wait(&ra->work, &ra->qlock);
+		}
+		if (ra->stop) {
+			break;
+		}
+		struct ra_req r = ra->q[ra->qhead];
+		ra->qhead = (ra->qhead + 1) % RA_QUEUE;
+		ra->qlen--;
+		ra->busy++;
+		pthread_mutex_unlock(&ra->qlock);
+
+		fetch(ra->img, r.offset, r.len);
+
+		pthread_mutex_lock(&ra->qlock);
+		if (--ra->busy == 0 && !ra->qlen) {
+			pthread_cond_broadcast(&ra->idle);
+		}
+	}
+	pthread_mutex_unlock(&ra->qlock);
+
+	return NULL;
+}
+
+// Queue a range to be read ahead, returns false if the queue is full
+static bool ra_queue(struct plus_ra *ra, off_t offset, size_t len)
+{
+	bool queued = true;
+
+	pthread_mutex_lock(&ra->qlock);
+	struct ra_req *t = ra->qlen ?
+		&ra->q[(ra->qhead + ra->qlen - 1) % RA_QUEUE] : NULL;
+	if (t && t->offset + (off_t)t->len == offset &&
+			t->len + len <= RA_MAX_REQ) {
+		t->len += len;
+	} else if (ra->qlen < RA_QUEUE) {
+		t = &ra->q[(ra->qhead + ra->qlen++) % RA_QUEUE];
+		t->offset = offset;
+		t->len = len;
+		pthread_cond_signal(&ra->work);
+	} else {
+		queued = false;
+	}
+	pthread_mutex_unlock(&ra->qlock);
+
+	if (queued) {
+		u32 cluster = ra->img->clusterSize;
+		TRACE(TR_READAHEAD, 0, offset / cluster, 0, offset % cluster,
+				len);
+	}
+	return queued;
+}
+
+// How much was read ahead for a stream, and not read yet
+static size_t stream_ahead(struct ra_stream *s)
+{
+	if (!s->stride) {
+		return s->ra > s->end ? s->ra - s->end : 0;
+	}
+	off_t next = s->last + s->stride;
+	return s->ra > next ? (s->ra - next) / s->stride * s->len : 0;
+}
+
+static void stream_init(struct plus_ra *ra, struct ra_stream *s,
+		off_t offset, size_t size)
+{
+	// Most of what was read ahead for it was never used, so
+	// the window is too big for this workload
+	if (s->used && s->hits && stream_ahead(s) > s->window / 2) {
+		ra->cap = MAX(ra->cap / 2, ra->min);
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->used = ++ra->clock;
+	s->last = offset;
+	s->end = offset + size;
+	s->len = size;
+	s->ra = s->end;
+	s->window = ra->min;
+}
+
+// Queue the next window of a stream, once half of the last one is read
+static void stream_ahead_queue(struct plus_ra *ra, struct ra_stream *s)
+{
+	u32 cluster = ra->img->clusterSize;
+	bool queued = false;
+
+	if (!s->stride) {
+		if (s->ra < s->end) {
+			// the reader is ahead of us
+			s->ra = s->end;
+		}
+		if (s->ra >= ra->size || stream_ahead(s) > s->window / 2) {
+			return;
+		}
+		off_t to = MIN(s->end + (off_t)s->window, ra->size);
+		if (ra_queue(ra, s->ra, to - s->ra)) {
+			s->ra = to;
+			queued = true;
+		}
+	} else {
+		off_t next = s->last + s->stride;
+		if (s->ra < next) {
+			s->ra = next;
+		}
+		// Every read costs at least a cluster
+		off_t nreads = MAX(s->window / MAX(s->len, cluster), 1);
+		if (stream_ahead(s) > s->window / 2) {
+			return;
+		}
+		while ((s->ra - next) / s->stride < nreads &&
+				s->ra + (off_t)s->len <= ra->size &&
+				ra_queue(ra, s->ra, s->len)) {
+			s->ra += s->stride;
+			queued = true;
+		}
+	}
+
+	if (!queued) {
+		return;
+	}
+	if (s->window < ra->cap) {
+		s->window = MIN(s->window * 2, ra->cap);
+	} else if (ra->cap < ra->max) {
+		ra->cap = MIN(ra->cap * 2, ra->max);
+	}
+}
+
+void ra_read(struct plus_image *img, off_t offset, size_t size)
+{
+	struct plus_ra *ra = img->ra;
+	struct ra_stream *hit = NULL, *cand = NULL, *lru = &ra->streams[0];
+
+	pthread_mutex_lock(&ra->lock);
+	for (int i = 0; i < RA_STREAMS; i++) {
+		struct ra_stream *s = &ra->streams[i];
+		if (s->used < lru->used) {
+			lru = s;
+		}
+		if (!s->used) {
+			continue;
+		}
+		if (s->stride ? offset == s->last + s->stride :
+				offset + RA_SLACK >= s->last &&
+				offset <= s->end + RA_SLACK) {
+			hit = s;
+			break;
+		}
+		// A read not far after the only read of a stream might be
+		// the second one of a strided stream
+		if (!s->hits && offset > s->end &&
+				offset - s->last <= RA_MAX_STRIDE) {
+			cand = s;
+		}
+	}
+
+	if (hit) {
+		hit->used = ++ra->clock;
+		hit->hits++;
+		hit->last = offset;
+		hit->len = size;
+		hit->end = hit->stride ? offset + (off_t)size :
+			MAX(hit->end, offset + (off_t)size);
+		stream_ahead_queue(ra, hit);
+	} else if (cand) {
+		cand->used = ++ra->clock;
+		cand->stride = offset - cand->last;
+		cand->last = offset;
+		cand->end = offset + size;
+		cand->len = size;
+	} else {
+		stream_init(ra, lru, offset, size);
+	}
+	pthread_mutex_unlock(&ra->lock);
+}
+
+void ra_drain(struct plus_image *img)
+{
+	struct plus_ra *ra = img->ra;
+
+	if (!ra) {
+		return;
+	}
+
+	pthread_mutex_lock(&ra->qlock);
+	ra->qlen = 0;
+	while (ra->busy) {
+		pthread_cond_wait(&ra->idle, &ra->qlock);
+	}
+	pthread_mutex_unlock(&ra->qlock);
+}
+
+void ra_free(struct plus_image *img)
+{
+	struct plus_ra *ra = img->ra;
+
+	if (!ra) {
+		return;
+	}
+
+	pthread_mutex_lock(&ra->qlock);
+	ra->stop = true;
+	ra->qlen = 0;
+	pthread_cond_broadcast(&ra->work);
+	pthread_mutex_unlock(&ra->qlock);
+	for (int i = 0; i < ra->nthreads; i++) {
+		pthread_join(ra->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&ra->lock);
+	pthread_mutex_destroy(&ra->qlock);
+	pthread_cond_destroy(&ra->work);
+	pthread_cond_destroy(&ra->idle);
+	free(ra);
+	img->ra = NULL;
+}
+
+int plus_readahead_setup(struct plus_image *img, int nthreads,
+		size_t max_window)
+{
+	if (!img) {
+		return -EBADF;
+	}
+
+	ra_free(img);
+	if (!nthreads) {
+		return 0;
+	}
+	if (nthreads < 0 || max_window < img->clusterSize) {
+		return -EINVAL;
+	}
+	// Clusters are read ahead into the cache, so without one there
+	// is nothing to do
+	int cached = 0;
+	for (int lvl = 0; lvl <= img->level && !cached; lvl++) {
+		int id;
+		cached = level_cache(img, lvl, &id) != NULL;
+	}
+	if (!cached) {
+		fprintf(stderr, "%s: no cluster cache to read ahead into\n",
+				__func__);
+		return -EINVAL;
+	}
+
+	struct plus_ra *ra = calloc(1, sizeof(*ra) +
+			nthreads * sizeof(ra->threads[0]));
+	if (!ra) {
+		return -ENOMEM;
+	}
+	ra->img = img;
+	ra->size = (off_t)img->clusterSize * img->bdevSize;
+	ra->max = max_window;
+	ra->min = MIN(MAX(RA_MIN, img->clusterSize), max_window);
+	ra->cap = ra->max;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_mutex_init(&ra->qlock, NULL);
+	pthread_cond_init(&ra->work, NULL);
+	pthread_cond_init(&ra->idle, NULL);
+	img->ra = ra;
+
+	for (int i = 0; i < nthreads; i++) {
+		int ret = pthread_create(&ra->threads[i], NULL, ra_thread, ra);
+		if (ret) {
+			fprintf(stderr, "%s: can't create thread: %s\n",
+					__func__, strerror(ret));
+			ra_free(img);
+			return -ret;
+		}
+		ra->nthreads++;
+	}
+
+	return 0;
+}
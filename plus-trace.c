@@ -0,0 +1,115 @@
+#ifdef PLUS_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "plus-trace.h"
+
+// Per-thread trace ring buffers, see plus-trace.h
+
+int trace_on;
+
+static const char *prefix;
+static pthread_key_t key;
+
+#define TRACE_FILE_SIZE	(sizeof(struct trace_hdr) + \
+		TRACE_EVENTS * sizeof(struct trace_event))
+
+static __thread struct trace_hdr *tbuf;
+static __thread int tfailed;
+
+static void trace_release(void *data)
+{
+	munmap(data, TRACE_FILE_SIZE);
+}
+
+__attribute__((constructor))
+static void trace_init(void)
+{
+	prefix = getenv("PLUS_TRACE");
+	if (!prefix || !*prefix) {
+		return;
+	}
+	if (pthread_key_create(&key, trace_release)) {
+		fprintf(stderr, "%s: can't create thread key\n", __func__);
+		return;
+	}
+	trace_on = 1;
+}
+
+static struct trace_hdr *trace_open(void)
+{
+	char name[PATH_MAX];
+	pid_t tid = syscall(SYS_gettid);
+
+	snprintf(name, sizeof(name), "%s.%d", prefix, tid);
+	int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: can't open %s: %m\n", __func__, name);
+		return NULL;
+	}
+	if (ftruncate(fd, TRACE_FILE_SIZE)) {
+		fprintf(stderr, "%s: can't resize %s: %m\n", __func__, name);
+		close(fd);
+		return NULL;
+	}
+	struct trace_hdr *h = mmap(NULL, TRACE_FILE_SIZE,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed: %m\n", __func__);
+		return NULL;
+	}
+
+	memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+	h->tid = tid;
+	h->nevents = TRACE_EVENTS;
+	h->head = 0;
+	pthread_setspecific(key, h);
+
+	return h;
+}
+
+void trace_event(u16 type, int lvl, u32 idx, u32 blk, u32 off, u64 len)
+{
+	struct trace_hdr *h = tbuf;
+
+	if (!h) {
+		if (tfailed) {
+			return;
+		}
+		h = tbuf = trace_open();
+		if (!h) {
+			tfailed = 1;
+			return;
+		}
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	// Only this thread ever writes to h, so no atomics are needed,
+	// except for making head visible after the event itself
+	u64 head = h->head;
+	struct trace_event *ev = (struct trace_event *)(h + 1);
+	struct trace_event *e = &ev[head & (TRACE_EVENTS - 1)];
+	e->ts = (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	e->type = type;
+	e->lvl = lvl;
+	e->pad = 0;
+	e->idx = idx;
+	e->blk = blk;
+	e->off = off;
+	e->len = len;
+	__atomic_store_n(&h->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif // PLUS_TRACE
@@ -0,0 +1,90 @@
+#ifndef _PLUS_TRACE_H_
+#define _PLUS_TRACE_H_
+
+// Binary tracing of the I/O paths, for debugging.
+//
+// Built in unless compiled with TRACE=0, and off unless PLUS_TRACE
+// environment variable is set to a file name prefix. Each thread then
+// logs events into its own ring buffer, which is an mmap()'ed file
+// named PREFIX.TID, so there is no locking and no syscalls per event.
+// Once the ring is full, older events are overwritten. Use trace-dump
+// to decode the files.
+
+#include "plus.h"
+
+#define TRACE_MAGIC	"PLUSTRC1"
+
+// Number of events per thread, must be a power of 2
+#define TRACE_EVENTS	(1U << 16)
+
+enum {
+	TR_READ,	// plus_read() request
+	TR_WRITE,	// plus_write() request
+	TR_RUN,		// read of a run of clusters, or a hole if blk is 0
+	TR_REWRITE,	// in-place write to a top delta cluster
+	TR_ALLOC,	// write to a newly allocated cluster
+	TR_GROW,	// top delta preallocation, len is in clusters
+	TR_FLUSH,	// plus_flush(), len is the number of BAT updates
+	TR_RING_READ,	// plus_submit_read() request
+	TR_RING_WRITE,	// plus_submit_write() request
+	TR_RING_DONE,	// io_uring op completion, len is the result;
+			// blk is non-zero if it writes idx -> blk
+	TR_MERGE,	// run of clusters copied by plus_merge() to lvl,
+			// len is in clusters
+	TR_SNAPSHOT,	// plus_snapshot(), lvl is the new top level,
+			// len is how long writes were held off, in ns
+	TR_DISCARD,	// plus_discard() request
+	TR_FREE,	// top delta cluster freed by plus_discard()
+	TR_ZERO,	// all-zero write, to what lvl and blk had been
+	TR_READAHEAD,	// readahead queued by a stream of reads
+	TR_STAGE,	// write staged in memory, see plus-wb.c
+	TR_MAX
+};
+
+// For requests, idx and off are the cluster number and offset within it
+struct trace_event {
+	u64 ts;		// CLOCK_MONOTONIC, in ns
+	u16 type;
+	u8  lvl;
+	u8  pad;
+	u32 idx;	// cluster number
+	u32 blk;	// block in the delta
+	u32 off;	// offset within the cluster
+	u64 len;
+};
+
+// Trace file header, followed by TRACE_EVENTS events
+struct trace_hdr {
+	char magic[8];
+	u32 tid;
+	u32 nevents;
+	u64 head;	// number of events ever written
+	u8  pad[40];	// keep events cacheline aligned
+};
+
+#ifdef PLUS_TRACE
+
+extern int trace_on;
+
+void trace_event(u16 type, int lvl, u32 idx, u32 blk, u32 off, u64 len);
+
+#define TRACE(type, lvl, idx, blk, off, len)				\
+	do {								\
+		if (__builtin_expect(trace_on, 0)) {			\
+			trace_event(type, lvl, idx, blk, off, len);	\
+		}							\
+	} while (0)
+
+#else
+
+// Arguments are still evaluated (and then thrown away), so that the
+// variables only used for tracing are not reported as unused
+#define TRACE(type, lvl, idx, blk, off, len)				\
+	do {								\
+		(void)(type); (void)(lvl); (void)(idx);			\
+		(void)(blk); (void)(off); (void)(len);			\
+	} while (0)
+
+#endif // PLUS_TRACE
+
+#endif // _PLUS_TRACE_H_
@@ -0,0 +1,851 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <linux/io_uring.h>
+
+#include "plus.h"
+#include "plus-int.h"
+#include "plus-trace.h"
+
+// Asynchronous I/O engine, using io_uring directly (no liburing).
+//
+// Delta file descriptors are registered as fixed files, indexed by level.
+// Caller buffers given to plus_ring_open() and our own bounce buffers
+// (used for read-modify-write of partially written new clusters) are
+// registered as fixed buffers.
+//
+// A ring is meant to be used by a single thread, but many rings (and
+// plus_read()/plus_write() callers) can share an image. A cluster is
+// allocated with its cluster lock held, like plus_write() does, but here
+// the lock is held until the write of the new cluster completes and it
+// is mapped, so that nobody else allocates it meanwhile. The locks are
+// only ever waited for with none of our own writes in flight, the rest
+// of the time ring requests are completed until they are free. Reads
+// bypass the cluster cache, but writes do invalidate it. All-zero
+// writes to holes are skipped, like plus_write() does.
+//
+// Write requests hold the image write gate until they complete, so
+// plus_snapshot() can't switch the top delta under them. Likewise, read
+// requests hold a read section until they complete, so that blocks freed
+// by plus_discard() are not reused while they are being read. Once there
+// is a new level, a ring drains, and registers the files anew.
+
+// Number of cluster-sized bounce buffers
+#define NR_BOUNCE	8
+
+// Max number of linked SQEs (read head, read tail, write)
+#define CHAIN_MAX	3
+
+// A single plus_submit_*() call
+struct ring_req {
+	plus_io_cb cb;
+	void *priv;
+	ssize_t ret;		// request size, or the first error
+	int pending;		// number of ops not yet completed
+	int write;		// holds the write gate
+	int read;		// holds a read section, begun in epoch
+	u32 epoch;
+	struct ring_req *next;	// in the list of completed requests
+};
+
+// A single SQE
+struct ring_op {
+	struct ring_req *req;
+	u32 len;		// expected result
+	int bounce;		// bounce buffer to release, or -1
+	int alloc;		// finishes allocation of cluster idx -> blk
+	u32 idx;
+	u32 blk;		// rewritten block, if not alloc
+};
+
+struct plus_ring {
+	struct plus_image *img;
+	int fd;
+
+	// SQ ring
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	// CQ ring
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned cq_entries;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len;
+
+	int nfiles;		// number of registered files
+	unsigned to_submit;	// queued, but not yet submitted
+	unsigned inflight;	// submitted, but not yet completed
+
+	// registered buffers, the last NR_BOUNCE are bounce buffers
+	struct iovec *bufs;
+	unsigned nbufs;
+	void *bounce;
+	unsigned bounce_free;	// bitmask of free bounce buffers
+
+	u8 *allocating;		// bitmap of clusters being allocated
+	u16 held[NR_CLUSTER_LOCKS]; // allocations holding each cluster lock
+	struct ring_req *done;	// completed requests
+};
+
+static inline unsigned load_acquire(unsigned *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(unsigned *p, unsigned v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline int test_alloc(struct plus_ring *ring, u32 idx)
+{
+	return ring->allocating[idx / 8] & (1 << (idx % 8));
+}
+
+static inline void set_alloc(struct plus_ring *ring, u32 idx, int on)
+{
+	if (on) {
+		ring->allocating[idx / 8] |= (1 << (idx % 8));
+	} else {
+		ring->allocating[idx / 8] &= ~(1 << (idx % 8));
+	}
+}
+
+static int wait_one(struct plus_ring *ring);
+
+// Take the cluster lock for allocating cluster idx. If someone else has
+// it, our requests in flight are completed while waiting, as they might
+// be holding the locks the other side is waiting for.
+static int lock_cluster(struct plus_ring *ring, u32 idx)
+{
+	pthread_mutex_t *lock =
+		&ring->img->cluster_locks[idx % NR_CLUSTER_LOCKS];
+	u16 *held = &ring->held[idx % NR_CLUSTER_LOCKS];
+
+	while (!*held && pthread_mutex_trylock(lock)) {
+		if (ring->inflight || ring->to_submit) {
+			int ret = wait_one(ring);
+			if (ret) {
+				return ret;
+			}
+		} else {
+			pthread_mutex_lock(lock);
+			break;
+		}
+	}
+	(*held)++;
+
+	return 0;
+}
+
+static void unlock_cluster(struct plus_ring *ring, u32 idx)
+{
+	if (--ring->held[idx % NR_CLUSTER_LOCKS] == 0) {
+		pthread_mutex_unlock(
+			&ring->img->cluster_locks[idx % NR_CLUSTER_LOCKS]);
+	}
+}
+
+static int ring_enter(struct plus_ring *ring, unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+	for (;;) {
+		int r = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+				min_complete, flags, NULL, 0);
+		if (r >= 0) {
+			ring->to_submit -= r;
+			ring->inflight += r;
+			return 0;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if ((errno == EAGAIN || errno == EBUSY) && ring->inflight) {
+			// let some requests complete and retry
+			flags = IORING_ENTER_GETEVENTS;
+			min_complete = 1;
+			continue;
+		}
+		fprintf(stderr, "%s: io_uring_enter: %m\n", __func__);
+		return -errno;
+	}
+}
+
+static void req_done(struct plus_ring *ring, struct ring_req *req)
+{
+	if (req->write) {
+		write_end(ring->img);
+	}
+	if (req->read) {
+		read_end(ring->img, req->epoch);
+	}
+	req->next = ring->done;
+	ring->done = req;
+}
+
+static void complete_op(struct plus_ring *ring, struct ring_op *op, int res)
+{
+	struct plus_image *img = ring->img;
+	struct ring_req *req = op->req;
+
+	TRACE(TR_RING_DONE, img->level, op->idx, op->blk, 0, res);
+	if (res >= 0 && (u32)res != op->len) {
+		res = -EIO; // short read or write
+	}
+	if (res < 0 && req->ret >= 0) {
+		req->ret = res;
+	}
+
+	if (op->alloc) {
+		if (res >= 0) {
+			// data is there, now it's safe to add the mapping
+			if ((map_set(img, op->idx, img->level, op->blk) ||
+					bat_update(img, op->idx, op->blk)) &&
+					req->ret >= 0) {
+				req->ret = -EIO;
+			}
+		}
+		set_alloc(ring, op->idx, 0);
+		unlock_cluster(ring, op->idx);
+	} else if (op->blk) {
+		cache_invalidate(img->cache, img->level, op->blk);
+	}
+	if (op->bounce >= 0) {
+		ring->bounce_free |= 1 << op->bounce;
+	}
+
+	if (--req->pending == 0) {
+		req_done(ring, req);
+	}
+	free(op);
+}
+
+// Process all the available completions, returns their number
+static unsigned reap(struct plus_ring *ring)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = load_acquire(ring->cq_tail);
+	unsigned n = 0;
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		complete_op(ring, (struct ring_op *)cqe->user_data, cqe->res);
+		head++;
+		n++;
+	}
+	store_release(ring->cq_head, head);
+	ring->inflight -= n;
+
+	return n;
+}
+
+// Submit whatever is queued, and wait for at least one completion
+static int wait_one(struct plus_ring *ring)
+{
+	int ret = ring_enter(ring, 1);
+	if (ret) {
+		return ret;
+	}
+	reap(ring);
+
+	return 0;
+}
+
+// Register delta fds, index is level, if there are new levels since
+// we last did it. Can't be done with requests in flight.
+static int update_files(struct plus_ring *ring)
+{
+	struct plus_image *img = ring->img;
+	int n = __atomic_load_n(&img->level, __ATOMIC_ACQUIRE) + 1;
+
+	if (n == ring->nfiles) {
+		return 0;
+	}
+	while (ring->inflight || ring->to_submit) {
+		int ret = wait_one(ring);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	if (ring->nfiles) {
+		syscall(__NR_io_uring_register, ring->fd,
+				IORING_UNREGISTER_FILES, NULL, 0);
+		ring->nfiles = 0;
+	}
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES,
+				img->fds, n)) {
+		fprintf(stderr, "%s: can't register files: %m\n", __func__);
+		return -errno;
+	}
+	ring->nfiles = n;
+
+	return 0;
+}
+
+// Make sure we can queue n more SQEs without submitting
+static int reserve_sqes(struct plus_ring *ring, unsigned n)
+{
+	// Don't let CQ overflow
+	while (ring->inflight + ring->to_submit + n > ring->cq_entries) {
+		int ret = wait_one(ring);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	while (*ring->sq_tail - load_acquire(ring->sq_head) + n > ring->sq_entries) {
+		// SQ is full, submit what we have
+		int ret = ring_enter(ring, 0);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct plus_ring *ring)
+{
+	if (reserve_sqes(ring, 1)) {
+		return NULL;
+	}
+
+	unsigned tail = *ring->sq_tail;
+	unsigned i = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[i] = i;
+	store_release(ring->sq_tail, tail + 1);
+	ring->to_submit++;
+
+	return sqe;
+}
+
+// Find a registered buffer containing [buf, buf + len)
+static int find_buf(struct plus_ring *ring, void *buf, size_t len)
+{
+	for (unsigned i = 0; i < ring->nbufs; i++) {
+		struct iovec *iov = &ring->bufs[i];
+		if (buf >= iov->iov_base &&
+				buf + len <= iov->iov_base + iov->iov_len) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Queue a read or write of len bytes at pos of level lvl
+static int queue_rw(struct plus_ring *ring, struct ring_req *req,
+		int write, int lvl, void *buf, u32 len, off_t pos,
+		unsigned flags, struct ring_op **opp)
+{
+	struct ring_op *op = calloc(1, sizeof(*op));
+	if (!op) {
+		return -ENOMEM;
+	}
+	op->req = req;
+	op->len = len;
+	op->bounce = -1;
+
+	struct io_uring_sqe *sqe = get_sqe(ring);
+	if (!sqe) {
+		free(op);
+		return -EIO;
+	}
+
+	int bi = find_buf(ring, buf, len);
+	if (bi >= 0) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = bi;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->flags = IOSQE_FIXED_FILE | flags;
+	sqe->fd = lvl;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = pos;
+	sqe->user_data = (unsigned long)op;
+
+	req->pending++;
+	if (opp) {
+		*opp = op;
+	}
+
+	return 0;
+}
+
+static struct ring_req *new_req(plus_io_cb cb, void *priv, size_t size)
+{
+	struct ring_req *req = calloc(1, sizeof(*req));
+	if (!req) {
+		return NULL;
+	}
+	req->cb = cb;
+	req->priv = priv;
+	req->ret = size;
+	// Hold a reference while submitting, so the request
+	// can't be completed before we queue all its ops
+	req->pending = 1;
+
+	return req;
+}
+
+static void put_req(struct plus_ring *ring, struct ring_req *req, int err)
+{
+	if (err && req->ret >= 0) {
+		req->ret = err;
+	}
+	if (--req->pending == 0) {
+		req_done(ring, req);
+	}
+}
+
+int plus_submit_read(struct plus_ring *ring, size_t size, off_t offset,
+		void *buf, plus_io_cb cb, void *priv)
+{
+	struct plus_image *img = ring->img;
+	int ret = sanity_checks(__func__, img, size, offset, buf);
+	if (ret) {
+		return ret;
+	}
+	TRACE(TR_RING_READ, 0, offset / img->clusterSize, 0,
+			offset % img->clusterSize, size);
+
+	struct ring_req *req = new_req(cb, priv, size);
+	if (!req) {
+		return -ENOMEM;
+	}
+	// Blocks being read are not reused until the request completes
+	req->read = 1;
+	req->epoch = read_begin(img);
+
+	u32 cluster = img->clusterSize;
+	size_t got = 0;
+
+	while (got < size) {
+		u32 idx = offset / cluster; // cluster number
+		u32 off = offset % cluster; // offset within the cluster
+		u32 want = (off + MIN(size - got, MAX_IO_SIZE) + cluster - 1) / cluster;
+		int lvl;
+		u32 blk;
+		u32 n = map_run(img, idx, want, &lvl, &blk);
+		size_t len = MIN((size_t)n * cluster - off, size - got);
+
+		if (blk && lvl >= ring->nfiles) {
+			// a new level, made by plus_snapshot()
+			ret = update_files(ring);
+			if (ret) {
+				break;
+			}
+		}
+		if (blk) {
+			off_t pos = (off_t)blk * cluster + off;
+			ret = queue_rw(ring, req, 0, lvl,
+					buf + got, len, pos, 0, NULL);
+			if (ret) {
+				break;
+			}
+		} else {
+			// hole
+			memset(buf + got, 0, len);
+		}
+		got += len;
+		offset += len;
+	}
+
+	put_req(ring, req, ret);
+	return 0;
+}
+
+static int get_bounce(struct plus_ring *ring)
+{
+	while (!ring->bounce_free) {
+		int ret = wait_one(ring);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	int b = ffs(ring->bounce_free) - 1;
+	ring->bounce_free &= ~(1 << b);
+
+	return b;
+}
+
+// Write to a cluster that is not yet in the top delta, which is mapped
+// to (lvl, oblk). Called with the cluster lock held, which is then held
+// until the write completes, unless it fails to be queued.
+static int queue_alloc(struct plus_ring *ring, struct ring_req *req,
+		u32 idx, int lvl, u32 oblk, u32 off, u32 len, void *buf)
+{
+	struct plus_image *img = ring->img;
+	u32 cluster = img->clusterSize;
+	int top_level = img->level;
+	int ret;
+
+	// Reserve a new cluster
+	u32 blk;
+	ret = alloc_cluster(img, &blk);
+	if (ret) {
+		return ret;
+	}
+
+	void *wbuf = buf;
+	int b = -1;
+	unsigned link = 0;
+	if (len < cluster) {
+		// partial write, need to reconstruct a cluster
+		b = get_bounce(ring);
+		if (b < 0) {
+			return b;
+		}
+		wbuf = ring->bufs[ring->nbufs - NR_BOUNCE + b].iov_base;
+		memcpy(wbuf + off, buf, len);
+
+		u32 end = off + len;
+		if (!oblk) {
+			memset(wbuf, 0, off);
+			memset(wbuf + end, 0, cluster - end);
+		} else {
+			// Read the old data around the new one, then write
+			// the whole cluster, as a chain of linked SQEs.
+			// They all must go in one submission.
+			ret = reserve_sqes(ring, CHAIN_MAX);
+			if (ret) {
+				goto err;
+			}
+			off_t opos = (off_t)oblk * cluster;
+			link = IOSQE_IO_LINK;
+			if (off) {
+				ret = queue_rw(ring, req, 0, lvl, wbuf, off,
+						opos, link, NULL);
+				if (ret) {
+					goto err;
+				}
+			}
+			if (end < cluster) {
+				ret = queue_rw(ring, req, 0, lvl, wbuf + end,
+						cluster - end, opos + end,
+						link, NULL);
+				if (ret) {
+					goto err;
+				}
+			}
+		}
+	}
+
+	struct ring_op *op;
+	ret = queue_rw(ring, req, 1, top_level, wbuf, cluster,
+			(off_t)blk * cluster, 0, &op);
+	if (ret) {
+		goto err;
+	}
+	op->bounce = b;
+	op->alloc = 1;
+	op->idx = idx;
+	op->blk = blk;
+	set_alloc(ring, idx, 1);
+
+	return 0;
+
+err:
+	if (link && ring->to_submit) {
+		// don't let the orphaned reads link to whatever comes next
+		unsigned i = (*ring->sq_tail - 1) & *ring->sq_mask;
+		ring->sqes[i].flags &= ~IOSQE_IO_LINK;
+	}
+	if (b >= 0) {
+		ring->bounce_free |= 1 << b;
+	}
+	return ret;
+}
+
+int plus_submit_write(struct plus_ring *ring, size_t size, off_t offset,
+		void *buf, plus_io_cb cb, void *priv)
+{
+	struct plus_image *img = ring->img;
+	int ret = sanity_checks(__func__, img, size, offset, buf);
+	if (ret) {
+		return ret;
+	}
+	TRACE(TR_RING_WRITE, 0, offset / img->clusterSize, 0,
+			offset % img->clusterSize, size);
+	if (img->mode == O_RDONLY) {
+		return -EROFS;
+	}
+
+	// While the gate is frozen, keep completing our own requests,
+	// as that's what plus_snapshot() is waiting for
+	while (!write_try_begin(img)) {
+		if (ring->inflight || ring->to_submit) {
+			ret = wait_one(ring);
+			if (ret) {
+				return ret;
+			}
+		} else {
+			write_wait(img);
+		}
+	}
+	ret = update_files(ring);
+	struct ring_req *req = ret ? NULL : new_req(cb, priv, size);
+	if (!req) {
+		write_end(img);
+		return ret ? ret : -ENOMEM;
+	}
+	req->write = 1;
+
+	u32 cluster = img->clusterSize;
+	int top_level = img->level;
+	size_t got = 0;
+
+	while (got < size) {
+		u32 idx = offset / cluster; // cluster number
+		u32 off = offset % cluster; // offset within the cluster
+		u32 len = MIN(cluster - off, size - got);
+
+		// Wait for the in-flight allocation of this cluster,
+		// so we don't allocate it twice
+		while (test_alloc(ring, idx)) {
+			ret = wait_one(ring);
+			if (ret) {
+				goto out;
+			}
+		}
+
+		int lvl;
+		u32 blk;
+		map_get(img, idx, &lvl, &blk);
+		int locked = 0;
+		if (!(blk && lvl == top_level) &&
+				(blk || !is_zero(buf + got, len))) {
+			// Allocate a new cluster. Only one writer may do it
+			// for a given cluster, others wait and then rewrite it.
+			ret = lock_cluster(ring, idx);
+			if (ret) {
+				goto out;
+			}
+			locked = 1;
+			map_get(img, idx, &lvl, &blk);
+		}
+		if (blk && lvl == top_level) {
+			// top level, existing block, rewrite in place
+			off_t pos = (off_t)blk * cluster + off;
+			struct ring_op *op;
+			ret = queue_rw(ring, req, 1, top_level,
+					buf + got, len, pos, 0, &op);
+			if (!ret) {
+				// so the cached copy is dropped once it's done
+				op->idx = idx;
+				op->blk = blk;
+			}
+		} else if (!locked) {
+			// a hole reads as zeroes already
+			TRACE(TR_ZERO, lvl, idx, blk, off, len);
+		} else {
+			ret = queue_alloc(ring, req, idx, lvl, blk, off, len,
+					buf + got);
+			// once queued, the lock is held until it's done
+			locked = ret;
+		}
+		if (locked) {
+			unlock_cluster(ring, idx);
+		}
+		if (ret) {
+			break;
+		}
+		got += len;
+		offset += len;
+	}
+
+out:
+	put_req(ring, req, ret);
+	return 0;
+}
+
+int plus_ring_wait(struct plus_ring *ring, unsigned min_complete)
+{
+	unsigned n = 0;
+
+	for (;;) {
+		int ret = ring_enter(ring, 0);
+		if (ret) {
+			return ret;
+		}
+		reap(ring);
+
+		// Run the callbacks
+		while (ring->done) {
+			struct ring_req *req = ring->done;
+			ring->done = req->next;
+			req->cb(req->ret, req->priv);
+			free(req);
+			n++;
+		}
+
+		if (n >= min_complete || !ring->inflight) {
+			break;
+		}
+		ret = ring_enter(ring, 1);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return n;
+}
+
+struct plus_ring *plus_ring_open(struct plus_image *img, unsigned depth,
+		const struct iovec *bufs, unsigned nbufs)
+{
+	if (img->wb) {
+		fprintf(stderr, "%s: can't be used with write-back staging\n",
+				__func__);
+		return NULL;
+	}
+
+	struct io_uring_params p;
+	struct plus_ring *ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		return NULL;
+	}
+	ring->img = img;
+	ring->fd = -1;
+	__atomic_add_fetch(&img->rings, 1, __ATOMIC_RELAXED);
+
+	ring->allocating = calloc((img->bdevSize + 7) / 8, 1);
+	if (!ring->allocating) {
+		goto err;
+	}
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, MAX(depth, CHAIN_MAX), &p);
+	if (ring->fd < 0) {
+		fprintf(stderr, "%s: io_uring_setup: %m\n", __func__);
+		goto err;
+	}
+	ring->sq_entries = p.sq_entries;
+	ring->cq_entries = p.cq_entries;
+
+	// Map the rings
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_len = ring->cq_len = MAX(ring->sq_len, ring->cq_len);
+	}
+	const int prot = PROT_READ | PROT_WRITE;
+	const int flags = MAP_SHARED | MAP_POPULATE;
+	ring->sq_ptr = mmap(NULL, ring->sq_len, prot, flags,
+			ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto err_mmap;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, prot, flags,
+				ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			goto err_mmap;
+		}
+	}
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			prot, flags, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err_mmap;
+	}
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+
+	if (update_files(ring)) {
+		goto err;
+	}
+
+	// Register caller buffers, followed by our bounce buffers
+	if (posix_memalign(&ring->bounce, PAGE_SIZE,
+				(size_t)NR_BOUNCE * img->clusterSize)) {
+		ring->bounce = NULL;
+		fprintf(stderr, "%s: can't allocate bounce buffers\n", __func__);
+		goto err;
+	}
+	ring->bounce_free = (1 << NR_BOUNCE) - 1;
+	ring->nbufs = nbufs + NR_BOUNCE;
+	ring->bufs = calloc(ring->nbufs, sizeof(*ring->bufs));
+	if (!ring->bufs) {
+		goto err;
+	}
+	memcpy(ring->bufs, bufs, nbufs * sizeof(*bufs));
+	for (int i = 0; i < NR_BOUNCE; i++) {
+		struct iovec *iov = &ring->bufs[nbufs + i];
+		iov->iov_base = ring->bounce + (size_t)i * img->clusterSize;
+		iov->iov_len = img->clusterSize;
+	}
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+				ring->bufs, ring->nbufs)) {
+		fprintf(stderr, "%s: can't register buffers: %m\n", __func__);
+		goto err;
+	}
+
+	return ring;
+
+err_mmap:
+	fprintf(stderr, "%s: mmap failed: %m\n", __func__);
+err:
+	plus_ring_close(ring);
+	return NULL;
+}
+
+void plus_ring_close(struct plus_ring *ring)
+{
+	if (!ring) {
+		return;
+	}
+
+	// Wait for everything in flight
+	while (ring->to_submit || ring->inflight) {
+		if (plus_ring_wait(ring, ~0U) < 0) {
+			break;
+		}
+	}
+
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+	}
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_len);
+	}
+	if (ring->sq_ptr) {
+		munmap(ring->sq_ptr, ring->sq_len);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	free(ring->bufs);
+	free(ring->bounce);
+	free(ring->allocating);
+	__atomic_sub_fetch(&ring->img->rings, 1, __ATOMIC_RELAXED);
+	free(ring);
+}
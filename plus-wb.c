@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "plus.h"
+#include "plus-int.h"
+#include "plus-trace.h"
+
+// Write-back staging of partial writes to new clusters.
+//
+// A write of less than a cluster to a cluster the top delta doesn't
+// have yet costs a whole new cluster: the rest of it is copied from the
+// level below, or zeroed. Guest filesystems (journals in particular)
+// tend to write a cluster a few pages at a time, and each of these
+// writes would go through the cycle again, so instead the data are
+// staged in a cluster-sized buffer, along with a bitmap of the pages
+// written. The cluster is written out once, when all of it is written
+// to, or when the buffer is needed for another one (the oldest goes
+// first), or when it has been dirty for too long, or on plus_flush();
+// only the pages not written to are read from below then.
+//
+// Staged clusters are never in the top delta, so plus_read() reads the
+// data from below, and then puts the staged pages over it. Writing out
+// a cluster sets its mapping first, and only then drops the buffer,
+// bumping seq, so a read that might have found neither checks if the
+// mapping has changed, and if so, is done again. The staged data are
+// modified and written out with the cluster lock held, like the
+// allocation of the cluster would be.
+//
+// Staged data are not durable, same as any write before plus_flush(),
+// which writes them all out first, and only then syncs the deltas.
+
+struct wb_ent {
+	u32 idx;
+	struct wb_ent *hnext;		// in hash chain
+	struct wb_ent *prev, *next;	// in the list, oldest first
+	u64 dirtied;			// when staged, in ns
+	void *data;			// cluster buffer
+	u64 valid[];			// bitmap of the pages written to
+};
+
+struct plus_wb {
+	struct plus_image *img;
+	u32 pages;		// pages per cluster
+	u64 max_age;		// in ns
+
+	pthread_mutex_t lock;	// everything below
+	u32 seq;		// bumped once staged data is written out
+	u32 n;			// number of staged clusters
+	struct wb_ent *head, *tail;
+	struct wb_ent **hash;
+	u32 hash_mask;
+	void *mem;		// all cluster buffers
+	void **free_bufs;	// unused cluster buffers
+	u32 nfree;
+
+	pthread_t flusher;	// writes out the old ones
+	pthread_cond_t cond;
+	bool stop;
+};
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline u32 hash_idx(struct plus_wb *wb, u32 idx)
+{
+	return (idx * 0x9E3779B1U) & wb->hash_mask;
+}
+
+static struct wb_ent *lookup(struct plus_wb *wb, u32 idx)
+{
+	struct wb_ent *e = wb->hash[hash_idx(wb, idx)];
+
+	while (e && e->idx != idx) {
+		e = e->hnext;
+	}
+
+	return e;
+}
+
+static inline bool page_valid(struct wb_ent *e, u32 p)
+{
+	return e->valid[p / 64] & (1ULL << (p % 64));
+}
+
+// Forget about an entry, once its data are written out
+static void drop(struct plus_wb *wb, struct wb_ent *e)
+{
+	struct wb_ent **p = &wb->hash[hash_idx(wb, e->idx)];
+	while (*p != e) {
+		p = &(*p)->hnext;
+	}
+	*p = e->hnext;
+
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		wb->head = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		wb->tail = e->prev;
+	}
+
+	wb->free_bufs[wb->nfree++] = e->data;
+	__atomic_sub_fetch(&wb->n, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&wb->seq, 1, __ATOMIC_RELEASE);
+	free(e);
+}
+
+u32 wb_seq(struct plus_image *img)
+{
+	return __atomic_load_n(&img->wb->seq, __ATOMIC_ACQUIRE);
+}
+
+bool wb_staged(struct plus_image *img, u32 idx, u32 n)
+{
+	struct plus_wb *wb = img->wb;
+	bool staged = false;
+
+	if (!__atomic_load_n(&wb->n, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	if (wb->n < n) {
+		// fewer staged clusters than there are in the range
+		for (struct wb_ent *e = wb->head; e && !staged; e = e->next) {
+			staged = e->idx >= idx && e->idx - idx < n;
+		}
+	} else {
+		for (u32 i = 0; i < n && !staged; i++) {
+			staged = lookup(wb, idx + i) != NULL;
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return staged;
+}
+
+// Copy the staged pages of e within [off, off + len) of the cluster
+static void overlay(struct wb_ent *e, u32 off, u32 len, void *buf)
+{
+	for (u32 p = off / PAGE_SIZE; p < (off + len) / PAGE_SIZE; p++) {
+		if (page_valid(e, p)) {
+			memcpy(buf + (size_t)p * PAGE_SIZE - off,
+					e->data + (size_t)p * PAGE_SIZE,
+					PAGE_SIZE);
+		}
+	}
+}
+
+void wb_overlay(struct plus_image *img, off_t offset, size_t len, void *buf)
+{
+	struct plus_wb *wb = img->wb;
+	u32 cluster = img->clusterSize;
+
+	if (!__atomic_load_n(&wb->n, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	u32 first = offset / cluster;
+	u32 last = (offset + len - 1) / cluster;
+	pthread_mutex_lock(&wb->lock);
+	if (wb->n < last - first + 1) {
+		// fewer staged clusters than there are in the range
+		for (struct wb_ent *e = wb->head; e; e = e->next) {
+			if (e->idx < first || e->idx > last) {
+				continue;
+			}
+			off_t pos = (off_t)e->idx * cluster;
+			u32 off = MAX(pos, offset) - pos;
+			u32 end = MIN(pos + cluster, offset + (off_t)len) - pos;
+			overlay(e, off, end - off, buf + (pos + off - offset));
+		}
+	} else {
+		for (u32 idx = first; idx <= last; idx++) {
+			struct wb_ent *e = lookup(wb, idx);
+			if (!e) {
+				continue;
+			}
+			off_t pos = (off_t)idx * cluster;
+			u32 off = MAX(pos, offset) - pos;
+			u32 end = MIN(pos + cluster, offset + (off_t)len) - pos;
+			overlay(e, off, end - off, buf + (pos + off - offset));
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+}
+
+int wb_writeout(struct plus_image *img, u32 idx)
+{
+	struct plus_wb *wb = img->wb;
+	u32 cluster = img->clusterSize;
+	int ret = 0;
+
+	pthread_mutex_lock(&wb->lock);
+	struct wb_ent *e = lookup(wb, idx);
+	pthread_mutex_unlock(&wb->lock);
+	if (!e) {
+		return 0;
+	}
+
+	int lvl;
+	u32 blk;
+	map_get(img, idx, &lvl, &blk);
+	if (blk && lvl == img->level) {
+		fprintf(stderr, "%s: cluster %u is staged, but is in the top "
+				"delta already\n", __func__, idx);
+		return -EIO;
+	}
+
+	// Fill in the pages not written to from below. Readers only ever
+	// look at the ones that were, so it's done without the lock.
+	off_t pos = (off_t)blk * cluster;
+	for (u32 p = 0; p < wb->pages; ) {
+		if (page_valid(e, p)) {
+			p++;
+			continue;
+		}
+		u32 n = 1;
+		while (p + n < wb->pages && !page_valid(e, p + n)) {
+			n++;
+		}
+		size_t off = (size_t)p * PAGE_SIZE;
+		size_t len = (size_t)n * PAGE_SIZE;
+		if (blk) {
+			ret = read_block(img->fds[lvl], e->data + off, len,
+					pos + off);
+			if (ret) {
+				return ret;
+			}
+		} else {
+			memset(e->data + off, 0, len);
+		}
+		p += n;
+	}
+
+	// Like in plus_write(), zeroes over a hole need not be written
+	bool zero = is_zero(e->data, cluster);
+	if (blk || !zero) {
+		struct iovec v = { e->data, cluster };
+		ret = write_new_cluster(img, idx, lvl, blk, 0, cluster,
+				zero ? NULL : &v, 1);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	drop(wb, e);
+	pthread_mutex_unlock(&wb->lock);
+
+	return 0;
+}
+
+// Write out the oldest cluster whose lock we can get, to make room.
+// Called with the lock of cluster idx held.
+static int evict(struct plus_image *img, u32 idx)
+{
+	struct plus_wb *wb = img->wb;
+	pthread_mutex_t *held = &img->cluster_locks[idx % NR_CLUSTER_LOCKS];
+	pthread_mutex_t *lock = NULL;
+	struct wb_ent *e;
+
+	// Cluster locks are taken before wb->lock, so only try them here
+	pthread_mutex_lock(&wb->lock);
+	for (e = wb->head; e; e = e->next) {
+		lock = &img->cluster_locks[e->idx % NR_CLUSTER_LOCKS];
+		if (lock == held || !pthread_mutex_trylock(lock)) {
+			break;
+		}
+	}
+	u32 victim = e ? e->idx : 0;
+	pthread_mutex_unlock(&wb->lock);
+	if (!e) {
+		return -EAGAIN;
+	}
+
+	int ret = wb_writeout(img, victim);
+	if (lock != held) {
+		pthread_mutex_unlock(lock);
+	}
+
+	return ret;
+}
+
+int wb_write(struct plus_image *img, u32 idx, u32 blk, u32 off, u32 len,
+		const struct iovec *v, int nv, bool zero)
+{
+	struct plus_wb *wb = img->wb;
+	u32 cluster = img->clusterSize;
+
+	pthread_mutex_lock(&wb->lock);
+	struct wb_ent *e = lookup(wb, idx);
+	if (!e && (len == cluster || (!blk && zero))) {
+		// nothing to gain from staging it
+		pthread_mutex_unlock(&wb->lock);
+		return 0;
+	}
+	if (!e) {
+		bool full = !wb->nfree;
+		pthread_mutex_unlock(&wb->lock);
+		if (full && evict(img, idx)) {
+			// no room, so it is written right away
+			return 0;
+		}
+
+		size_t bits = (wb->pages + 63) / 64 * sizeof(u64);
+		e = calloc(1, sizeof(*e) + bits);
+		pthread_mutex_lock(&wb->lock);
+		if (!e || !wb->nfree) {
+			pthread_mutex_unlock(&wb->lock);
+			free(e);
+			return 0;
+		}
+		e->idx = idx;
+		e->dirtied = now_ns();
+		e->data = wb->free_bufs[--wb->nfree];
+		u32 h = hash_idx(wb, idx);
+		e->hnext = wb->hash[h];
+		wb->hash[h] = e;
+		e->prev = wb->tail;
+		if (wb->tail) {
+			wb->tail->next = e;
+		} else {
+			wb->head = e;
+		}
+		wb->tail = e;
+		__atomic_add_fetch(&wb->n, 1, __ATOMIC_RELEASE);
+	}
+	TRACE(TR_STAGE, 0, idx, 0, off, len);
+
+	void *to = e->data + off;
+	for (int i = 0; i < nv; i++) {
+		memcpy(to, v[i].iov_base, v[i].iov_len);
+		to += v[i].iov_len;
+	}
+	for (u32 p = off / PAGE_SIZE; p < (off + len) / PAGE_SIZE; p++) {
+		e->valid[p / 64] |= 1ULL << (p % 64);
+	}
+	bool all = true;
+	for (u32 p = 0; p < wb->pages && all; p++) {
+		all = page_valid(e, p);
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	if (all) {
+		// nothing to read from below, so no reason to wait
+		int ret = wb_writeout(img, idx);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 1;
+}
+
+int wb_flush(struct plus_image *img)
+{
+	struct plus_wb *wb = img->wb;
+	int ret = 0;
+
+	if (!wb) {
+		return 0;
+	}
+
+	// Clusters staged after we're called are not ours to flush
+	u64 until = now_ns();
+	while (!ret) {
+		pthread_mutex_lock(&wb->lock);
+		struct wb_ent *e = wb->head;
+		bool done = !e || e->dirtied > until;
+		u32 idx = e ? e->idx : 0;
+		pthread_mutex_unlock(&wb->lock);
+		if (done) {
+			break;
+		}
+
+		pthread_mutex_t *lock = &img->cluster_locks[idx % NR_CLUSTER_LOCKS];
+		pthread_mutex_lock(lock);
+		ret = wb_writeout(img, idx);
+		pthread_mutex_unlock(lock);
+	}
+
+	return ret;
+}
+
+// Write out the clusters staged for longer than max_age
+static void *flusher_fn(void *arg)
+{
+	struct plus_wb *wb = arg;
+	struct plus_image *img = wb->img;
+
+	pthread_mutex_lock(&wb->lock);
+	while (!wb->stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		u64 t = ts.tv_nsec + wb->max_age / 2;
+		ts.tv_sec += t / 1000000000;
+		ts.tv_nsec = t % 1000000000;
+		pthread_cond_timedwait(&wb->cond, &wb->lock, &ts);
+
+		while (!wb->stop && wb->head &&
+				now_ns() - wb->head->dirtied >= wb->max_age) {
+			u32 idx = wb->head->idx;
+			pthread_mutex_unlock(&wb->lock);
+
+			pthread_mutex_t *lock =
+				&img->cluster_locks[idx % NR_CLUSTER_LOCKS];
+			write_begin(img);
+			pthread_mutex_lock(lock);
+			int ret = wb_writeout(img, idx);
+			pthread_mutex_unlock(lock);
+			write_end(img);
+
+			pthread_mutex_lock(&wb->lock);
+			if (ret) {
+				// try again later
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return NULL;
+}
+
+int wb_free(struct plus_image *img)
+{
+	struct plus_wb *wb = img->wb;
+
+	if (!wb) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	wb->stop = true;
+	pthread_cond_signal(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+	pthread_join(wb->flusher, NULL);
+
+	int ret = wb_flush(img);
+	if (ret) {
+		fprintf(stderr, "%s: can't write out staged data: %d, "
+				"%u clusters lost\n", __func__, ret, wb->n);
+	}
+
+	while (wb->head) {
+		drop(wb, wb->head);
+	}
+	free(wb->hash);
+	free(wb->free_bufs);
+	free(wb->mem);
+	pthread_mutex_destroy(&wb->lock);
+	pthread_cond_destroy(&wb->cond);
+	free(wb);
+	img->wb = NULL;
+
+	return ret;
+}
+
+int plus_writeback_setup(struct plus_image *img, size_t size,
+		unsigned max_age_ms)
+{
+	if (!img) {
+		return -EBADF;
+	}
+	if (size && __atomic_load_n(&img->rings, __ATOMIC_RELAXED)) {
+		fprintf(stderr, "%s: can't be used with rings\n", __func__);
+		return -EBUSY;
+	}
+
+	int ret = wb_free(img);
+	if (ret || !size) {
+		return ret;
+	}
+	if (img->mode == O_RDONLY) {
+		return -EROFS;
+	}
+	u32 nslots = size / img->clusterSize;
+	if (!nslots || !max_age_ms) {
+		return -EINVAL;
+	}
+
+	struct plus_wb *wb = calloc(1, sizeof(*wb));
+	if (!wb) {
+		return -ENOMEM;
+	}
+	ret = -ENOMEM;
+	wb->img = img;
+	wb->pages = img->clusterSize / PAGE_SIZE;
+	wb->max_age = max_age_ms * 1000000ULL;
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_cond_init(&wb->cond, NULL);
+
+	u32 nhash = 1;
+	while (nhash < nslots * 2) {
+		nhash <<= 1;
+	}
+	wb->hash_mask = nhash - 1;
+	wb->hash = calloc(nhash, sizeof(*wb->hash));
+	wb->free_bufs = malloc(nslots * sizeof(*wb->free_bufs));
+	if (!wb->hash || !wb->free_bufs || posix_memalign(&wb->mem,
+				PAGE_SIZE, (size_t)nslots * img->clusterSize)) {
+		fprintf(stderr, "%s: can't allocate %u clusters\n",
+				__func__, nslots);
+		wb->mem = NULL;
+		goto err;
+	}
+	for (u32 i = 0; i < nslots; i++) {
+		wb->free_bufs[i] = wb->mem + (size_t)i * img->clusterSize;
+	}
+	wb->nfree = nslots;
+
+	ret = pthread_create(&wb->flusher, NULL, flusher_fn, wb);
+	if (ret) {
+		fprintf(stderr, "%s: can't create thread: %s\n",
+				__func__, strerror(ret));
+		ret = -ret;
+		goto err;
+	}
+	img->wb = wb;
+
+	return 0;
+
+err:
+	free(wb->hash);
+	free(wb->free_bufs);
+	free(wb->mem);
+	pthread_mutex_destroy(&wb->lock);
+	pthread_cond_destroy(&wb->cond);
+	free(wb);
+	return ret;
+}
@@ -8,21 +8,23 @@
 #include <errno.h>
 #include <sys/mman.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include <linux/types.h>
+#include <linux/falloc.h>
 
 #include <ploop/ploop_if.h>
 #include <ploop/ploop1_image.h>
 
 #include "plus.h"
+#include "plus-int.h"
+#include "plus-trace.h"
 
 #define S2B(sec) ((off_t)(sec) << PLOOP1_SECTOR_LOG)
 
-#define PAGE_SIZE	4096
-
-// Size of ploop on-disk image header, in 32-bit words
-#define HDR_SIZE_32	16 // sizeof(struct ploop_pvd_header) / sizeof(u32)
-
 static int p_memalign(void **memptr, size_t size)
 {
 	int ret;
@@ -35,7 +37,50 @@ static int p_memalign(void **memptr, size_t size)
 	return ret;
 }
 
-static int open_delta(struct plus_image *img, const char *name, int rw)
+// Parsed BAT of a delta, used while loading the maps
+struct delta_bat {
+	const char *name;
+	u32 *bat;	// mmap()'ed BAT, including the header
+	u32 batSize;	// in clusters
+	u32 bdevSize;	// in clusters
+	u32 allocSize;	// in clusters
+};
+
+// Use a delta shared with other images as the next level
+static int attach_shared(struct plus_image *img, const char *name,
+		struct shared_delta *sd, struct delta_bat *db)
+{
+	int level = img->level + 1;
+
+	if (level == 0) {
+		img->clusterSize = sd->clusterSize;
+	} else if (sd->clusterSize != img->clusterSize) {
+		fprintf(stderr, "Error: img %s got different "
+				"cluster size %d\n",
+				name, sd->clusterSize);
+		host_put(sd);
+		return -1;
+	}
+	img->allocSize = sd->allocSize;
+	img->preallocSize = img->allocSize;
+	img->batSize = sd->batSize;
+	img->bdevSize = sd->bdevSize;
+
+	db->bat = sd->bat;
+	db->name = name;
+	db->batSize = sd->batSize;
+	db->bdevSize = sd->bdevSize;
+	db->allocSize = sd->allocSize;
+
+	img->fds[level] = sd->fd;
+	img->shared[level] = sd;
+	img->level = level;
+
+	return 0;
+}
+
+static int open_delta(struct plus_image *img, const char *name, int rw,
+		struct delta_bat *db)
 {
 	int level = img->level + 1;
 	int fd = -1;
@@ -51,6 +96,26 @@ static int open_delta(struct plus_image *img, const char *name, int rw)
 		return -1;
 	}
 
+	struct stat st;
+	if (fstat(fd, &st)) {
+		perror("stat");
+		goto err;
+	}
+
+	// In host mode, it might be opened by some other image already
+	struct shared_delta *sd = host_mode() ? host_get(&st) : NULL;
+	if (sd) {
+		close(fd);
+		if (rw) {
+			fprintf(stderr, "Image %s is used read-only "
+					"by other images\n", name);
+			host_put(sd);
+			return -1;
+		}
+		printf("== img %s (shared) ==\n\n", name);
+		return attach_shared(img, name, sd, db);
+	}
+
 	// Read the header
 	int r = read(fd, img->buf, PAGE_SIZE);
 	if (r != PAGE_SIZE) {
@@ -92,7 +157,8 @@ static int open_delta(struct plus_image *img, const char *name, int rw)
 		if (clusterSize != DEF_CLUSTER) {
 			// realloc buf
 			free(img->buf);
-			if (p_memalign(img->buf, clusterSize)) {
+			if (p_memalign(&img->buf, clusterSize)) {
+				img->buf = NULL;
 				goto err;
 			}
 		}
@@ -107,116 +173,270 @@ static int open_delta(struct plus_image *img, const char *name, int rw)
 		}
 	}
 
-	struct stat st;
-	if (fstat(fd, &st)) {
-		perror("stat");
-		goto err;
-	}
-
 	// Allocated size, i.e. max (last) addressable cluster in the image
 	img->allocSize = ((st.st_size + clusterSize - 1) / clusterSize);
+	img->preallocSize = img->allocSize;
 	// BAT table size
 	img->batSize = batSize;
+	// The top delta defines the block device size
+	img->bdevSize = bdevSize;
 
 	printf("== img %s ==\n", name);
 	printf("level: %2d cluster: %5d bat: %5d bdev: %5d alloc: %5d\n\n",
 			level, clusterSize, batSize, bdevSize, img->allocSize);
 
-	if (bdevSize != img->bdevSize) {
-		// (re)alloc maps
-		int lvlsz = sizeof(*img->map_lvl);
-		int mapsz = sizeof(*img->map_blk);
-		img->map_lvl = realloc(img->map_lvl, bdevSize * lvlsz);
-		if (!img->map_lvl) {
-			perror("realloc");
+	// Map the BAT; it is parsed later by load_maps()
+	size_t len = (size_t)batSize * clusterSize;
+	db->bat = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (db->bat == MAP_FAILED) {
+		db->bat = NULL;
+		fprintf(stderr, "Can't mmap BAT of %s: %m\n", name);
+		goto err;
+	}
+	madvise(db->bat, len, MADV_SEQUENTIAL);
+	madvise(db->bat, len, MADV_WILLNEED);
+	db->name = name;
+	db->batSize = batSize;
+	db->bdevSize = bdevSize;
+	db->allocSize = img->allocSize;
+
+	if (!rw && host_mode()) {
+		sd = host_add(&st, fd, db->bat, clusterSize, batSize,
+				bdevSize, img->allocSize);
+		if (!sd) {
+			fprintf(stderr, "Can't share %s\n", name);
+			munmap(db->bat, len);
+			db->bat = NULL;
 			goto err;
 		}
+		if (sd->fd != fd) {
+			// somebody has just opened it too, use theirs
+			munmap(db->bat, len);
+			close(fd);
+		}
+		return attach_shared(img, name, sd, db);
+	}
 
-		img->map_blk = realloc(img->map_blk, bdevSize * mapsz);
-		if (!img->map_blk) {
-			perror("realloc");
-			goto err;
+	img->fds[level] = fd;
+	img->level = level;
+
+	return 0;
+
+err:
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return -1;
+}
+
+// Find the next non-zero entry in bat[i..n). As BATs are mostly sparse,
+// skip zeroes a 64-byte block (16 entries) at a time, or-ing machine
+// words together, which the compiler turns into vector instructions.
+static inline u32 next_entry(const u32 *bat, u32 i, u32 n)
+{
+	while (i < n && (i % 16)) {
+		if (bat[i]) {
+			return i;
 		}
-		if (bdevSize > img->bdevSize) {
-			// if we grew, zero the new map area
-			u32 add = bdevSize - img->bdevSize;
-			memset(img->map_lvl + img->bdevSize, 0, add * lvlsz);
-			memset(img->map_blk + img->bdevSize, 0, add * mapsz);
+		i++;
+	}
+	for (; i + 16 <= n; i += 16) {
+		const unsigned long *w = (const unsigned long *)(bat + i);
+		unsigned long v = 0;
+		for (u32 j = 0; j < 64 / sizeof(*w); j++) {
+			v |= w[j];
+		}
+		if (v) {
+			break;
 		}
-		// save the size
-		img->bdevSize = bdevSize;
+	}
+	while (i < n && !bat[i]) {
+		i++;
 	}
 
-	// Read the BAT block(s)
-	u32 idx = 0;
-	for (u32 b = 0; b < batSize; b++) {
-		ssize_t r = pread(fd, img->buf, clusterSize, clusterSize * b);
-		if (r != clusterSize) {
-			perror("pread");
-			goto err;
+	return i;
+}
+
+// Same trick for whole buffers. Non-zero data are usually found
+// in the first block, so it costs next to nothing.
+bool is_zero(const void *buf, size_t len)
+{
+	const unsigned long *w = buf;
+	const size_t per = 64 / sizeof(*w);
+
+	for (size_t i = 0; i < len / sizeof(*w); i += per) {
+		unsigned long v = 0;
+		for (size_t j = 0; j < per; j++) {
+			v |= w[i + j];
 		}
-		// first few BAT entries of the first block are reserved
-		// for the image header so we need to skip it
-		int i0 = (b == 0) ? HDR_SIZE_32 : 0;
+		if (v) {
+			return false;
+		}
+	}
 
-		// fill in the maps
-		u32 *bat = img->buf;
-		for (u32 i = i0; i < clusterSize / 4; i++, idx++) {
-			if (bat[i] == 0) {
-				continue;
+	return true;
+}
+
+struct load_arg {
+	struct plus_image *img;
+	struct delta_bat *dbs;
+	u32 lo, hi;	// range of map chunks to handle
+	int ret;
+	pthread_t thread;
+};
+
+// Fill in the map for clusters [lo, lo + len) into lvl/blk arrays,
+// going through all the levels, from the base up, so upper levels
+// override lower ones
+static int load_chunk(struct plus_image *img, struct delta_bat *dbs,
+		u32 lo, u32 len, u8 *lvl, u32 *blk)
+{
+	for (int level = 0; level <= img->level; level++) {
+		struct delta_bat *db = &dbs[level];
+
+		if (level == img->level && img->lower_map) {
+			// Remember what is below the top, see plus_discard().
+			// Chunks are a multiple of 8 clusters, so threads
+			// never share a byte.
+			for (u32 i = 0; i < len; i++) {
+				if (blk[i]) {
+					img->lower_map[(lo + i) / 8] |=
+						1 << ((lo + i) % 8);
+				}
 			}
+		}
+		// BAT index of the cluster is off by the header size
+		u32 n = db->batSize * (img->clusterSize / 4);
+		u32 i = HDR_SIZE_32 + lo;
+		u32 end = MIN((u64)HDR_SIZE_32 + lo + len, n);
+
+		while ((i = next_entry(db->bat, i, end)) < end) {
+			u32 idx = i - HDR_SIZE_32;
+			u32 b = db->bat[i++];
+
 			// sanity checks
-			if (idx > bdevSize) { // and non-zero value
-				fprintf(stderr, "Error: BAT entry beyond "
-						"block device size "
-						"(%u -> %u)\n",
-						idx, bat[i]);
-				goto err;
-			}
-			if (bat[i] >= img->allocSize) {
-				fprintf(stderr, "Error: BAT entry points "
-						"past EOF (%u -> %u)\n",
-						idx, bat[i]);
-				goto err;
+			const char *err = NULL;
+			if (idx >= db->bdevSize) {
+				err = "beyond block device size";
+			} else if (b >= db->allocSize) {
+				err = "points past EOF";
+			} else if (b < db->batSize) {
+				err = "points to before data blocks";
 			}
-			if (bat[i] < batSize) {
-				fprintf(stderr, "Error: BAT entry points "
-						"to before data blocks "
+			if (err) {
+				fprintf(stderr, "Error: %s: BAT entry %s "
 						"(%u -> %u)\n",
-						idx, bat[i]);
-				goto err;
+						db->name, err, idx, b);
+				return -1;
 			}
 			// assign
-			img->map_lvl[idx] = level;
-			img->map_blk[idx] = bat[i];
-			printf("%3d %5u -> %5u\n", level, idx, bat[i]);
+			lvl[idx - lo] = level;
+			blk[idx - lo] = b;
 		}
 	}
 
-	img->fds[level] = fd;
-	img->level = level;
-
 	return 0;
+}
 
-err:
-	if (fd >= 0) {
-		close(fd);
+static void *load_range(void *data)
+{
+	struct load_arg *a = data;
+	struct plus_image *img = a->img;
+	u8  *lvl = malloc(MAP_CHUNK * sizeof(*lvl));
+	u32 *blk = malloc(MAP_CHUNK * sizeof(*blk));
+
+	if (!lvl || !blk) {
+		perror("malloc");
+		a->ret = -1;
+		goto out;
 	}
 
-	return -1;
+	for (u32 c = a->lo; c < a->hi; c++) {
+		u32 lo = c * MAP_CHUNK;
+		u32 len = MIN(MAP_CHUNK, img->bdevSize - lo);
+
+		memset(lvl, 0, MAP_CHUNK * sizeof(*lvl));
+		memset(blk, 0, MAP_CHUNK * sizeof(*blk));
+		if (load_chunk(img, a->dbs, lo, len, lvl, blk) ||
+				map_build_chunk(img, c, lvl, blk)) {
+			a->ret = -1;
+			break;
+		}
+	}
+
+out:
+	free(lvl);
+	free(blk);
+	return NULL;
+}
+
+#define LOAD_MAX_THREADS	16
+
+// Build the combined map out of BATs of all the levels,
+// in parallel over ranges of map chunks
+static int load_maps(struct plus_image *img, struct delta_bat *dbs)
+{
+	if (map_init(img)) {
+		perror("calloc");
+		return -1;
+	}
+
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = MIN(nthreads, LOAD_MAX_THREADS);
+	nthreads = MIN(nthreads, img->nchunks);
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+
+	struct load_arg args[LOAD_MAX_THREADS];
+	u32 per = (img->nchunks + nthreads - 1) / nthreads;
+	int ret = 0;
+	long started = 0;
+	for (long t = 0; t < nthreads; t++) {
+		struct load_arg *a = &args[t];
+		a->img = img;
+		a->dbs = dbs;
+		a->lo = MIN(per * t, img->nchunks);
+		a->hi = MIN(per * (t + 1), img->nchunks);
+		a->ret = 0;
+		if (t == nthreads - 1) {
+			// do the last range ourselves
+			load_range(a);
+		} else if (pthread_create(&a->thread, NULL, load_range, a)) {
+			fprintf(stderr, "%s: can't create thread\n", __func__);
+			a->ret = -1;
+			break;
+		} else {
+			started++;
+		}
+	}
+	for (long t = 0; t < nthreads; t++) {
+		if (t < started) {
+			pthread_join(args[t].thread, NULL);
+		}
+		if (args[t].ret) {
+			ret = -1;
+		}
+	}
+
+	return ret;
 }
 
 static int close_deltas(struct plus_image *img)
 {
-	int l = img->level;
-	do {
-		close(img->fds[l]);
-	} while (l-- >= 0);
+	for (int l = img->level; l >= 0; l--) {
+		if (img->shared[l]) {
+			host_put(img->shared[l]);
+		} else {
+			close(img->fds[l]);
+		}
+	}
 
 	return 0;
 }
 
-static void mark_in_use(void *ptr, bool inuse)
+void mark_in_use(void *ptr, bool inuse)
 {
 	// Mark the image as either dirty or clean
 	struct ploop_pvd_header *pvd = (struct ploop_pvd_header *)ptr;
@@ -227,8 +447,301 @@ static void mark_in_use(void *ptr, bool inuse)
 	}
 }
 
+// Grow the top delta by preallocChunk clusters, called with alloc_lock
+static int prealloc_clusters(struct plus_image *img)
+{
+	int wfd = img->fds[img->level];
+	u32 cluster = img->clusterSize;
+	u32 n = img->preallocChunk ? img->preallocChunk : 1;
+	off_t pos = (off_t)img->preallocSize * cluster;
+	off_t len = (off_t)n * cluster;
+
+	TRACE(TR_GROW, img->level, img->preallocSize, 0, 0, n);
+	if (fallocate(wfd, 0, pos, len)) {
+		if (errno != EOPNOTSUPP) {
+			fprintf(stderr, "Error in fallocate: %m\n");
+			return -errno;
+		}
+		// filesystem can't do it, just grow the file
+		if (ftruncate(wfd, pos + len)) {
+			fprintf(stderr, "Error in ftruncate: %m\n");
+			return -errno;
+		}
+	}
+	__atomic_store_n(&img->preallocSize, img->preallocSize + n,
+			__ATOMIC_RELEASE);
+
+	return 0;
+}
+
+// Try to take a cluster from the preallocated tail
+static bool take_cluster(struct plus_image *img, u32 *blk)
+{
+	u32 b = __atomic_load_n(&img->allocSize, __ATOMIC_RELAXED);
+
+	while (b < __atomic_load_n(&img->preallocSize, __ATOMIC_ACQUIRE)) {
+		if (__atomic_compare_exchange_n(&img->allocSize, &b, b + 1,
+					false, __ATOMIC_ACQ_REL,
+					__ATOMIC_RELAXED)) {
+			*blk = b;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Mark block blk of the top delta free, called with alloc_lock held
+static void put_free(struct plus_image *img, u32 blk)
+{
+	if (blk >= img->free_bits) {
+		u32 bits = MAX(img->free_bits * 2, (blk + 64) & ~63U);
+		u64 *m = realloc(img->free_map, bits / 8);
+		if (!m) {
+			// it's only lost until the image is reopened
+			return;
+		}
+		memset(m + img->free_bits / 64, 0, (bits - img->free_bits) / 8);
+		img->free_map = m;
+		img->free_bits = bits;
+	}
+
+	u64 bit = 1ULL << (blk % 64);
+	if (img->free_map[blk / 64] & bit) {
+		return;
+	}
+	img->free_map[blk / 64] |= bit;
+	__atomic_store_n(&img->nfree, img->nfree + 1, __ATOMIC_RELAXED);
+	if (blk < img->free_hint) {
+		img->free_hint = blk;
+	}
+}
+
+// Take the lowest free block, called with alloc_lock held
+static bool take_free(struct plus_image *img, u32 *blk)
+{
+	for (u32 w = img->free_hint / 64;
+			img->nfree && w < img->free_bits / 64; w++) {
+		u64 v = img->free_map[w];
+		if (!v) {
+			continue;
+		}
+		u32 b = w * 64 + __builtin_ctzll(v);
+		img->free_map[w] = v & (v - 1);
+		__atomic_store_n(&img->nfree, img->nfree - 1, __ATOMIC_RELAXED);
+		img->free_hint = b + 1;
+		*blk = b;
+		return true;
+	}
+
+	return false;
+}
+
+static bool is_free(struct plus_image *img, u32 blk)
+{
+	return blk < img->free_bits &&
+		(img->free_map[blk / 64] & (1ULL << (blk % 64)));
+}
+
+// Find the blocks of the top delta no BAT entry points to: those freed
+// by plus_discard() before, or allocated but not yet in BAT when we
+// crashed.
+static int init_free_map(struct plus_image *img)
+{
+	const u32 *bat = img->wbat;
+	u32 n = img->batSize * (img->clusterSize / 4);
+
+	img->free_bits = (img->allocSize + 63) & ~63U;
+	img->free_map = calloc(img->free_bits / 64 + 1, sizeof(u64));
+	if (!img->free_map) {
+		return -1;
+	}
+	for (u32 b = img->batSize; b < img->allocSize; b++) {
+		img->free_map[b / 64] |= 1ULL << (b % 64);
+	}
+	for (u32 i = HDR_SIZE_32; (i = next_entry(bat, i, n)) < n; i++) {
+		u32 b = bat[i];
+		if (b < img->allocSize) {
+			img->free_map[b / 64] &= ~(1ULL << (b % 64));
+		}
+	}
+	for (u32 w = 0; w < img->free_bits / 64; w++) {
+		img->nfree += __builtin_popcountll(img->free_map[w]);
+	}
+	img->free_hint = img->batSize;
+
+	return 0;
+}
+
+int alloc_cluster(struct plus_image *img, u32 *blk)
+{
+	// Reuse a free block, if there are any
+	if (__atomic_load_n(&img->nfree, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&img->alloc_lock);
+		bool ok = take_free(img, blk);
+		pthread_mutex_unlock(&img->alloc_lock);
+		if (ok) {
+			// someone might have cached it before it was freed
+			cache_invalidate(img->cache, img->level, *blk);
+			return 0;
+		}
+	}
+
+	// Fast path, no locking
+	if (take_cluster(img, blk)) {
+		return 0;
+	}
+
+	// Need to grow the file. Others might be taking the new clusters
+	// as soon as we grow it, so we might need to do it more than once.
+	int ret = 0;
+	pthread_mutex_lock(&img->alloc_lock);
+	while (!take_cluster(img, blk)) {
+		ret = prealloc_clusters(img);
+		if (ret) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&img->alloc_lock);
+
+	return ret;
+}
+
+bool write_try_begin(struct plus_image *img)
+{
+	// Pairs with gate_freeze() setting frozen, then checking writers
+	__atomic_add_fetch(&img->writers, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&img->frozen, __ATOMIC_SEQ_CST)) {
+		return true;
+	}
+	write_end(img);
+
+	return false;
+}
+
+void write_wait(struct plus_image *img)
+{
+	pthread_mutex_lock(&img->gate_lock);
+	while (img->frozen) {
+		pthread_cond_wait(&img->gate_cond, &img->gate_lock);
+	}
+	pthread_mutex_unlock(&img->gate_lock);
+}
+
+void write_begin(struct plus_image *img)
+{
+	while (!write_try_begin(img)) {
+		write_wait(img);
+	}
+}
+
+void write_end(struct plus_image *img)
+{
+	if (__atomic_sub_fetch(&img->writers, 1, __ATOMIC_SEQ_CST) == 0 &&
+			__atomic_load_n(&img->frozen, __ATOMIC_SEQ_CST)) {
+		// the last one, let plus_snapshot() proceed
+		pthread_mutex_lock(&img->gate_lock);
+		pthread_cond_broadcast(&img->gate_cond);
+		pthread_mutex_unlock(&img->gate_lock);
+	}
+}
+
+u32 read_begin(struct plus_image *img)
+{
+	for (;;) {
+		u32 e = __atomic_load_n(&img->epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&img->readers[e & 1], 1, __ATOMIC_SEQ_CST);
+		// Pairs with read_sync() bumping epoch, then checking readers
+		if (__atomic_load_n(&img->epoch, __ATOMIC_SEQ_CST) == e) {
+			return e;
+		}
+		read_end(img, e);
+	}
+}
+
+void read_end(struct plus_image *img, u32 epoch)
+{
+	__atomic_sub_fetch(&img->readers[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+// Wait for the reads that began before now. Those which begin after it
+// see whatever was in the map by then.
+static void read_sync(struct plus_image *img)
+{
+	pthread_mutex_lock(&img->epoch_lock);
+	u32 e = __atomic_fetch_add(&img->epoch, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&img->readers[e & 1], __ATOMIC_SEQ_CST)) {
+		usleep(100);
+	}
+	pthread_mutex_unlock(&img->epoch_lock);
+}
+
+// Hold off new writes, and wait for those in progress. It can be frozen
+// by more than one thread at once, and is thawed once they all are done.
+static void gate_freeze(struct plus_image *img)
+{
+	pthread_mutex_lock(&img->gate_lock);
+	__atomic_add_fetch(&img->frozen, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&img->writers, __ATOMIC_SEQ_CST)) {
+		pthread_cond_wait(&img->gate_cond, &img->gate_lock);
+	}
+	pthread_mutex_unlock(&img->gate_lock);
+}
+
+static void gate_thaw(struct plus_image *img)
+{
+	pthread_mutex_lock(&img->gate_lock);
+	__atomic_sub_fetch(&img->frozen, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&img->gate_cond);
+	pthread_mutex_unlock(&img->gate_lock);
+}
+
+// Cut off the unused part of the preallocated tail, along with the free
+// blocks at the end. Called when there are no writes in progress.
+static int trim_prealloc(struct plus_image *img)
+{
+	pthread_mutex_lock(&img->alloc_lock);
+	while (img->allocSize > img->batSize &&
+			is_free(img, img->allocSize - 1)) {
+		u32 b = --img->allocSize;
+		img->free_map[b / 64] &= ~(1ULL << (b % 64));
+		img->nfree--;
+	}
+	pthread_mutex_unlock(&img->alloc_lock);
+
+	if (img->preallocSize <= img->allocSize) {
+		return 0;
+	}
+
+	int wfd = img->fds[img->level];
+	if (ftruncate(wfd, (off_t)img->allocSize * img->clusterSize)) {
+		fprintf(stderr, "%s: error in ftruncate: %m\n", __func__);
+		return -errno;
+	}
+	img->preallocSize = img->allocSize;
+
+	return 0;
+}
+
+static void unmap_bats(struct plus_image *img, struct delta_bat *dbs)
+{
+	if (!dbs) {
+		return;
+	}
+
+	for (int l = 0; l <= img->level; l++) {
+		// shared BATs stay mapped until the delta is closed
+		if (dbs[l].bat && !img->shared[l]) {
+			munmap(dbs[l].bat, (size_t)dbs[l].batSize * img->clusterSize);
+		}
+	}
+	free(dbs);
+}
+
 struct plus_image *plus_open(int count, char **deltas, int mode)
 {
+	struct delta_bat *dbs = NULL;
+
 	// Allocate img
 	struct plus_image *img = calloc(1, sizeof(struct plus_image));
 	if (!img) {
@@ -239,22 +752,63 @@ struct plus_image *plus_open(int count, char **deltas, int mode)
 	img->level = -1;
 	img->mode = mode;
 	img->max_levels = count;
+	img->preallocChunk = PREALLOC_CHUNK;
+	pthread_mutex_init(&img->alloc_lock, NULL);
+	pthread_mutex_init(&img->bat_lock, NULL);
+	pthread_mutex_init(&img->map_lock, NULL);
+	pthread_mutex_init(&img->level_lock, NULL);
+	pthread_mutex_init(&img->gate_lock, NULL);
+	pthread_cond_init(&img->gate_cond, NULL);
+	pthread_mutex_init(&img->epoch_lock, NULL);
 	img->fds = calloc(count, sizeof(*img->fds));
-	if (!img->fds) {
+	img->shared = calloc(count, sizeof(*img->shared));
+	img->merged = calloc(count, sizeof(*img->merged));
+	if (!img->fds || !img->shared || !img->merged) {
+		goto err;
+	}
+	img->cluster_locks = calloc(NR_CLUSTER_LOCKS,
+			sizeof(*img->cluster_locks));
+	if (!img->cluster_locks) {
 		goto err;
 	}
+	for (int i = 0; i < NR_CLUSTER_LOCKS; i++) {
+		pthread_mutex_init(&img->cluster_locks[i], NULL);
+	}
+	img->page_locks = calloc(NR_PAGE_LOCKS, sizeof(*img->page_locks));
+	if (!img->page_locks) {
+		goto err;
+	}
+	for (int i = 0; i < NR_PAGE_LOCKS; i++) {
+		pthread_mutex_init(&img->page_locks[i], NULL);
+	}
 
 	// initial buffer
 	if (p_memalign(&img->buf, DEF_CLUSTER)) {
 		goto err;
 	}
 
+	dbs = calloc(count, sizeof(*dbs));
+	if (!dbs) {
+		goto err;
+	}
+	struct delta_bat *db = dbs;
 	while (count--) {
 		int rw = count == 0 && mode != O_RDONLY;
-		if (open_delta(img, *deltas++, rw) < 0) {
+		if (open_delta(img, *deltas++, rw, db++) < 0) {
+			goto err;
+		}
+	}
+	if (mode != O_RDONLY) {
+		img->lower_map = calloc((img->bdevSize + 7) / 8, 1);
+		if (!img->lower_map) {
 			goto err;
 		}
 	}
+	if (load_maps(img, dbs)) {
+		goto err;
+	}
+	unmap_bats(img, dbs);
+	dbs = NULL;
 
 	// mmap top delta BAT table for efficient writes
 	if (mode != O_RDONLY) {
@@ -271,25 +825,33 @@ struct plus_image *plus_open(int count, char **deltas, int mode)
 		}
 		// Mark the image as dirty
 		mark_in_use(img->wbat, true);
+
+		// Pending BAT updates
+		img->dirty_idx = malloc(BAT_BATCH * sizeof(*img->dirty_idx));
+		img->dirty_blk = malloc(BAT_BATCH * sizeof(*img->dirty_blk));
+		u32 npages = img->batSize * (img->clusterSize / PAGE_SIZE);
+		img->dirty_pages = calloc((npages + 7) / 8, 1);
+		if (!img->dirty_idx || !img->dirty_blk || !img->dirty_pages) {
+			fprintf(stderr, "Can't allocate BAT update buffers\n");
+			goto err;
+		}
+		if (init_free_map(img)) {
+			fprintf(stderr, "Can't allocate free blocks map\n");
+			goto err;
+		}
 	}
 
 	img->max_idx = (img->batSize * img->clusterSize / 4) - HDR_SIZE_32;
 
-	printf("Combined map follows:\n");
-	for (u32 idx = 0; idx < img->bdevSize; idx++) {
-		if (img->map_blk[idx]) {
-			printf("%5u -> %2d,%5u\n", idx,
-					img->map_lvl[idx],
-					img->map_blk[idx]);
-		}
-	}
-	printf("levels: %2d cluster: %5d bat: %5d (max idx: %5d) bdev: %5d alloc: %5d\n\n",
+	printf("levels: %2d cluster: %5d bat: %5d (max idx: %5d) bdev: %5d alloc: %5d map: %zd bytes\n\n",
 			img->max_levels, img->clusterSize, img->batSize,
-			img->max_idx, img->bdevSize, img->allocSize);
+			img->max_idx, img->bdevSize, img->allocSize,
+			map_mem(img));
 
 	return img;
 
 err:
+	unmap_bats(img, dbs);
 	plus_close(img);
 	return NULL;
 }
@@ -300,7 +862,13 @@ int plus_close(struct plus_image *img)
 		return 0;
 	}
 
+	ra_free(img);
+	wb_free(img);
 	if (img->mode != O_RDONLY && img->wbat != NULL) {
+		// Release what we have preallocated but not used,
+		// then write out pending metadata
+		trim_prealloc(img);
+		plus_flush(img);
 		// Mark the image as clean
 		mark_in_use(img->wbat, false);
 		// unmap the writeable BAT
@@ -311,22 +879,49 @@ int plus_close(struct plus_image *img)
 	}
 
 	free(img->buf);
+	mmap_free(img);
 	close_deltas(img);
+	cache_free(img->cache);
+
+	map_free(img);
 
-	free(img->map_lvl);
-	free(img->map_blk);
+	free(img->dirty_idx);
+	free(img->dirty_blk);
+	free(img->dirty_pages);
+	free(img->free_map);
+	free(img->lower_map);
 
 	free(img->fds);
+	free(img->shared);
+	free(img->merged);
+
+	if (img->cluster_locks) {
+		for (int i = 0; i < NR_CLUSTER_LOCKS; i++) {
+			pthread_mutex_destroy(&img->cluster_locks[i]);
+		}
+		free(img->cluster_locks);
+	}
+	if (img->page_locks) {
+		for (int i = 0; i < NR_PAGE_LOCKS; i++) {
+			pthread_mutex_destroy(&img->page_locks[i]);
+		}
+		free(img->page_locks);
+	}
+	pthread_mutex_destroy(&img->alloc_lock);
+	pthread_mutex_destroy(&img->bat_lock);
+	pthread_mutex_destroy(&img->map_lock);
+	pthread_mutex_destroy(&img->level_lock);
+	pthread_mutex_destroy(&img->gate_lock);
+	pthread_mutex_destroy(&img->epoch_lock);
+	pthread_cond_destroy(&img->gate_cond);
 
 	free(img);
 
 	return 0;
 }
 
-#define MIN(a, b)	((a) < (b) ? (a) : (b))
-
 // Sanity checks common for read and write
-static inline int sanity_checks(const char *func,
+int sanity_checks(const char *func,
 		struct plus_image *img, size_t size, off_t offset, void *buf)
 {
 	if (!img) {
@@ -339,6 +934,16 @@ static inline int sanity_checks(const char *func,
 		return -EINVAL;
 	}
 
+	return range_checks(func, img, size, offset);
+}
+
+int range_checks(const char *func,
+		struct plus_image *img, size_t size, off_t offset)
+{
+	if (!img) {
+		return -EBADF;
+	}
+
 	// Is it past EOF?
 	u32 idx = (size + offset) / img->clusterSize;
 	if (idx > img->bdevSize) {
@@ -356,15 +961,12 @@ static inline int sanity_checks(const char *func,
 		return -E2BIG;
 	}
 
-	printf("%s offset=%5zd size=%5zd\n", func, offset, size);
 	return 0;
 }
 
-static int read_block(int fd, void *buf, size_t len, off_t pos)
+int read_block(int fd, void *buf, size_t len, off_t pos)
 {
-	printf("pread(%d, %p, %zd, %zu) = ", fd, buf, len, pos);
 	ssize_t r = pread(fd, buf, len, pos);
-	printf("%zd (%m)\n", r);
 	if ((size_t)r == len) {
 		return 0;
 	}
@@ -377,188 +979,1187 @@ static int read_block(int fd, void *buf, size_t len, off_t pos)
 	}
 }
 
-ssize_t plus_read(struct plus_image *img, size_t size, off_t offset, void *buf)
+struct plus_cache *level_cache(struct plus_image *img, int lvl, int *id)
 {
-	int ret = sanity_checks(__func__, img, size, offset, buf);
-	if (ret) {
-		return ret;
+	struct shared_delta *sd = img->shared[lvl];
+
+	if (sd && sd->cache) {
+		*id = 0;
+		return sd->cache;
+	}
+	*id = lvl;
+	return img->cache;
+}
+
+// Position within a vector of buffers
+struct iov_pos {
+	const struct iovec *iov;
+	int i;		// current buffer
+	size_t skip;	// how much of it is done
+};
+
+// Describe the next *len bytes from pos by at most IOV_MAX buffers,
+// cutting *len short if it takes more. Returns the number of buffers.
+static int iov_slice(const struct iov_pos *pos, size_t *len, struct iovec *v)
+{
+	int i = pos->i, n = 0;
+	size_t skip = pos->skip, got = 0;
+
+	while (got < *len && n < IOV_MAX) {
+		size_t l = MIN(pos->iov[i].iov_len - skip, *len - got);
+		if (l) {
+			v[n].iov_base = pos->iov[i].iov_base + skip;
+			v[n].iov_len = l;
+			n++;
+			got += l;
+		}
+		i++;
+		skip = 0;
+	}
+	*len = got;
+
+	return n;
+}
+
+static void iov_advance(struct iov_pos *pos, size_t len)
+{
+	while (len) {
+		size_t l = MIN(pos->iov[pos->i].iov_len - pos->skip, len);
+		pos->skip += l;
+		len -= l;
+		if (pos->skip == pos->iov[pos->i].iov_len) {
+			pos->i++;
+			pos->skip = 0;
+		}
+	}
+}
+
+// Sanity checks for a vector of buffers, also sums up their sizes
+static int iov_checks(const char *func, struct plus_image *img,
+		const struct iovec *iov, int iovcnt, off_t offset, size_t *size)
+{
+	if (iovcnt < 0 || (iovcnt && !iov)) {
+		return -EINVAL;
+	}
+
+	*size = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		if (((size_t)iov[i].iov_base % PAGE_SIZE) ||
+				(iov[i].iov_len % PAGE_SIZE)) {
+			fprintf(stderr, "%s: buffer %d unaligned\n", func, i);
+			return -EINVAL;
+		}
+		*size += iov[i].iov_len;
+	}
+
+	return sanity_checks(func, img, *size, offset, NULL);
+}
+
+// Same as read_block(), for a vector of buffers
+static int read_vec(int fd, const struct iovec *v, int nv, size_t len,
+		off_t pos)
+{
+	if (nv == 1) {
+		return read_block(fd, v[0].iov_base, len, pos);
+	}
+
+	ssize_t r = preadv(fd, v, nv, pos);
+	if ((size_t)r == len) {
+		return 0;
+	}
+	fprintf(stderr, "Error in preadv(%d, %d buffers, %zd, %zu) = %zd: %m\n",
+			fd, nv, len, pos, r);
+	return r < 0 ? -errno : -EIO;
+}
+
+// Write exactly len bytes from a vector of buffers, returns 0 or -errno
+static int write_vec(int fd, const struct iovec *v, int nv, size_t len,
+		off_t pos)
+{
+	ssize_t r = pwritev(fd, v, nv, pos);
+	if ((size_t)r == len) {
+		return 0;
+	}
+	fprintf(stderr, "Error in pwritev(%d, %d buffers, %zd, %zu) = %zd: %m\n",
+			fd, nv, len, pos, r);
+	return r < 0 ? -errno : -EIO;
+}
+
+// Read size bytes at offset into the buffers, which are checked already
+static ssize_t read_iov(struct plus_image *img, const struct iovec *iov,
+		size_t size, off_t offset)
+{
+	TRACE(TR_READ, 0, offset / img->clusterSize, 0,
+			offset % img->clusterSize, size);
+	if (img->ra) {
+		ra_read(img, offset, size);
 	}
 
 	u32 cluster = img->clusterSize;
 	size_t got = 0; // How much we have read so far
+	struct iov_pos at = { iov, 0, 0 }; // where it goes
+	struct iovec v[IOV_MAX];
+	int ret = 0;
+	// Blocks found in the map are not reused until we are done
+	u32 epoch = read_begin(img);
 
 	while (got < size) {
 		// Cluster number, and offset within it
 		u32 idx = offset / cluster; // cluster number
 		u32 off = offset % cluster; // offset within the cluster
-		u32 len = MIN(cluster - off, size - got); // how much to read
-
-		int lvl = img->map_lvl[idx];
-		int blk = img->map_blk[idx];
-		printf("  R %5d -> %2d, %5d  off=%5d size=%5d\n",
-			idx, lvl, blk, off, len);
-		if (blk) {
+		// Number of clusters this request touches from here on
+		u32 want = (off + MIN(size - got, MAX_IO_SIZE) + cluster - 1) / cluster;
+		int lvl;
+		u32 blk;
+		u32 seq = img->wb ? wb_seq(img) : 0;
+		u32 n = map_run(img, idx, want, &lvl, &blk);
+		// how much to read, and the buffers it goes to
+		size_t len = MIN((size_t)n * cluster - off, size - got);
+		int nv = iov_slice(&at, &len, v);
+
+		TRACE(TR_RUN, lvl, idx, blk, off, len);
+		// offset in the delta file
+		off_t pos = (off_t)blk * cluster + off;
+		const void *p = blk && img->mmap ?
+			mmap_ptr(img, lvl, pos, len) : NULL;
+		int id;
+		struct plus_cache *c = blk && !p ?
+			level_cache(img, lvl, &id) : NULL;
+		if (p) {
+			// mapped, no need to go to disk
+			for (int i = 0; i < nv; i++) {
+				memcpy(v[i].iov_base, p, v[i].iov_len);
+				p += v[i].iov_len;
+			}
+		}
+		else if (c) {
+			// go through the cache, cluster by cluster
+			for (int i = 0; i < nv; i++) {
+				size_t done = 0;
+				while (done < v[i].iov_len) {
+					u32 l = MIN(cluster - off,
+							v[i].iov_len - done);
+					ret = cache_read(c, id, img->fds[lvl],
+							blk, off, l,
+							v[i].iov_base + done);
+					if (ret) {
+						goto out;
+					}
+					done += l;
+					off += l;
+					if (off == cluster) {
+						off = 0;
+						blk++;
+					}
+				}
+			}
+		}
+		else if (blk) {
 			// do actual read
-			// offset in the delta file
-			off_t pos = blk * cluster + off;
-			int ret = read_block(img->fds[lvl], buf + got, len, pos);
+			ret = read_vec(img->fds[lvl], v, nv, len, pos);
 			if (ret) {
-				return ret;
+				goto out;
 			}
 		}
 		else {
-			// just zero out buf
-//			memset(buf + got, 0, len);
+			// just zero out the buffers
+			for (int i = 0; i < nv; i++) {
+				memset(v[i].iov_base, 0, v[i].iov_len);
+			}
+		}
+		// Staged writes are never in the top delta
+		if (img->wb && (!blk || lvl !=
+				__atomic_load_n(&img->level, __ATOMIC_ACQUIRE))) {
+			off_t o = offset;
+			for (int i = 0; i < nv; i++) {
+				wb_overlay(img, o, v[i].iov_len, v[i].iov_base);
+				o += v[i].iov_len;
+			}
+			int l;
+			u32 b;
+			if (wb_seq(img) != seq &&
+					(map_run(img, idx, n, &l, &b) != n ||
+					 l != lvl || (off_t)b * cluster +
+					 offset % cluster != pos)) {
+				// written out meanwhile, read it again
+				continue;
+			}
 		}
+		iov_advance(&at, len);
 		got += len;
 		offset += len;
 	}
+out:
+	read_end(img, epoch);
+
+	return ret ? ret : (ssize_t)got;
+}
+
+static inline bool io_aligned(size_t size, off_t offset, const void *buf)
+{
+	return !(((size_t)buf | size | (size_t)offset) % PAGE_SIZE);
+}
+
+static ssize_t unaligned_io(const char *func, struct plus_image *img,
+		bool write, size_t size, off_t offset, void *buf);
+
+ssize_t plus_read(struct plus_image *img, size_t size, off_t offset, void *buf)
+{
+	if (!io_aligned(size, offset, buf)) {
+		return unaligned_io(__func__, img, false, size, offset, buf);
+	}
+
+	int ret = sanity_checks(__func__, img, size, offset, buf);
+	if (ret) {
+		return ret;
+	}
+
+	struct iovec iov = { buf, size };
+	return read_iov(img, &iov, size, offset);
+}
+
+ssize_t plus_readv(struct plus_image *img, const struct iovec *iov,
+		int iovcnt, off_t offset)
+{
+	size_t size;
+	int ret = iov_checks(__func__, img, iov, iovcnt, offset, &size);
+	if (ret) {
+		return ret;
+	}
+
+	return read_iov(img, iov, size, offset);
+}
+
+int plus_map_extents(struct plus_image *img, off_t offset, size_t len,
+		struct plus_extent *ext, int max)
+{
+	if (!img) {
+		return -EBADF;
+	}
+
+	u32 cluster = img->clusterSize;
+	off_t end = (off_t)cluster * img->bdevSize;
+	if (offset < 0 || offset > end) {
+		return -EINVAL;
+	}
+	if (len > (size_t)(end - offset)) {
+		len = end - offset;
+	}
+
+	int n = 0;
+	size_t got = 0;
+	while (got < len && n < max) {
+		u32 idx = offset / cluster; // cluster number
+		u32 off = offset % cluster; // offset within the cluster
+		u32 want = (off + MIN(len - got, MAX_IO_SIZE) + cluster - 1) / cluster;
+		int lvl;
+		u32 blk;
+		u32 run = map_run(img, idx, want, &lvl, &blk);
+		size_t l = MIN((size_t)run * cluster - off, len - got);
+
+		// map_run() stops at MAX_IO_SIZE, so we might need to
+		// extend the previous extent
+		struct plus_extent *e = &ext[n];
+		if (!blk) {
+			lvl = -1;
+		}
+		off_t pos = blk ? (off_t)blk * cluster + off : 0;
+		if (n > 0) {
+			struct plus_extent *p = &ext[n - 1];
+			if (p->level == lvl &&
+					(lvl < 0 || p->pos + (off_t)p->len == pos)) {
+				e = p;
+			}
+		}
+		if (e == &ext[n]) {
+			e->offset = offset;
+			e->len = 0;
+			e->level = lvl;
+			e->pos = pos;
+			n++;
+		}
+		e->len += l;
+
+		got += l;
+		offset += l;
+	}
 
-	return got;
+	return n;
+}
+
+int plus_changed_extents(struct plus_image *img, int base, off_t offset,
+		size_t len, struct plus_extent *ext, int max)
+{
+	if (!img) {
+		return -EBADF;
+	}
+	if (base < -1 || base > img->level) {
+		return -EINVAL;
+	}
+
+	u32 cluster = img->clusterSize;
+	off_t end = (off_t)cluster * img->bdevSize;
+	if (offset < 0 || offset > end) {
+		return -EINVAL;
+	}
+	if (len > (size_t)(end - offset)) {
+		len = end - offset;
+	}
+
+	int n = 0;
+	size_t got = 0;
+	while (got < len && n < max) {
+		u32 idx = offset / cluster;
+		u32 off = offset % cluster;
+		u32 want = (off + MIN(len - got, MAX_IO_SIZE) + cluster - 1) / cluster;
+		int lvl;
+		u32 blk;
+		u32 run = map_run(img, idx, want, &lvl, &blk);
+		size_t l = MIN((size_t)run * cluster - off, len - got);
+
+		// Holes and the data of base and below haven't changed
+		if (blk && lvl > base) {
+			off_t pos = (off_t)blk * cluster + off;
+			struct plus_extent *p = n ? &ext[n - 1] : NULL;
+			if (p && p->level == lvl &&
+					p->offset + (off_t)p->len == offset &&
+					p->pos + (off_t)p->len == pos) {
+				p->len += l;
+			} else {
+				p = &ext[n++];
+				p->offset = offset;
+				p->len = l;
+				p->level = lvl;
+				p->pos = pos;
+			}
+		}
+
+		got += l;
+		offset += l;
+	}
+
+	return n;
 }
 
 static int write_bat_entry(struct plus_image *img, u32 idx, u32 cluster)
 {
 	u32 *bat = (u32*)img->wbat + HDR_SIZE_32;
-	if (bat[idx] != 0) {
+	// A cluster can be freed, then allocated again, but not reallocated
+	if (cluster && bat[idx] != 0) {
 		fprintf(stderr, "%s: unexpected BAT entry %d -> %d\n",
 				__func__, idx, bat[idx]);
 		return -1;
 	}
 	bat[idx] = cluster;
 
+	// remember the BAT page we have modified
+	u32 page = (HDR_SIZE_32 + idx) * sizeof(u32) / PAGE_SIZE;
+	img->dirty_pages[page / 8] |= 1 << (page % 8);
+
 	return 0;
 }
 
-ssize_t plus_write(struct plus_image *img, size_t size, off_t offset, void *buf)
+static int flush_locked(struct plus_image *img);
+
+int bat_update(struct plus_image *img, u32 idx, u32 cluster)
 {
-	int ret = sanity_checks(__func__, img, size, offset, buf);
+	int ret = 0;
+
+	pthread_mutex_lock(&img->bat_lock);
+	if (img->ndirty == BAT_BATCH) {
+		ret = flush_locked(img);
+	}
+	if (!ret) {
+		img->dirty_idx[img->ndirty] = idx;
+		img->dirty_blk[img->ndirty] = cluster;
+		img->ndirty++;
+	}
+	pthread_mutex_unlock(&img->bat_lock);
+
+	return ret;
+}
+
+int plus_flush(struct plus_image *img)
+{
+	if (!img) {
+		return -EBADF;
+	}
+	if (img->mode == O_RDONLY) {
+		return 0;
+	}
+	if (img->wb) {
+		// Staged data first, so they are synced below
+		write_begin(img);
+		int ret = wb_flush(img);
+		write_end(img);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	pthread_mutex_lock(&img->bat_lock);
+	int ret = flush_locked(img);
+	pthread_mutex_unlock(&img->bat_lock);
+
+	return ret;
+}
+
+// Called with bat_lock held
+static int flush_locked(struct plus_image *img)
+{
+	TRACE(TR_FLUSH, img->level, 0, 0, 0, img->ndirty);
+
+	// 1. Make sure all the data written so far is on disk,
+	// including the new clusters the queued BAT entries point to
+	int wfd = img->fds[img->level];
+	if (fdatasync(wfd)) {
+		fprintf(stderr, "%s: fdatasync: %m\n", __func__);
+		return -errno;
+	}
+	if (!img->ndirty) {
+		return 0;
+	}
+
+	// 2. Update the BAT
+	int ret = 0;
+	for (u32 i = 0; i < img->ndirty; i++) {
+		if (write_bat_entry(img, img->dirty_idx[i], img->dirty_blk[i])) {
+			ret = -EIO;
+		}
+	}
+	img->ndirty = 0;
+
+	// 3. Write out the modified BAT pages, merging adjacent ones
+	u32 npages = img->batSize * (img->clusterSize / PAGE_SIZE);
+	for (u32 p = 0; p < npages; p++) {
+		u32 n = 0;
+		while (p + n < npages &&
+				img->dirty_pages[(p + n) / 8] & (1 << ((p + n) % 8))) {
+			img->dirty_pages[(p + n) / 8] &= ~(1 << ((p + n) % 8));
+			n++;
+		}
+		if (!n) {
+			continue;
+		}
+		if (msync(img->wbat + (size_t)p * PAGE_SIZE,
+					(size_t)n * PAGE_SIZE, MS_SYNC)) {
+			fprintf(stderr, "%s: msync: %m\n", __func__);
+			ret = -errno;
+		}
+		p += n;
+	}
+
+	return ret;
+}
+
+// Per-thread cluster-sized buffers, for copying data around
+struct thread_buf {
+	void *ptr;
+	size_t size;
+};
+
+static pthread_key_t buf_key;
+static pthread_once_t buf_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_buf(void *p)
+{
+	struct thread_buf *tb = p;
+
+	free(tb->ptr);
+	free(tb);
+}
+
+static void init_buf_key(void)
+{
+	if (pthread_key_create(&buf_key, free_thread_buf)) {
+		fprintf(stderr, "%s: can't create thread key\n", __func__);
+		abort();
+	}
+}
+
+// Get an aligned per-thread buffer at least size bytes long
+static void *get_thread_buf(size_t size)
+{
+	pthread_once(&buf_once, init_buf_key);
+
+	struct thread_buf *tb = pthread_getspecific(buf_key);
+	if (!tb) {
+		tb = calloc(1, sizeof(*tb));
+		if (!tb) {
+			return NULL;
+		}
+		if (pthread_setspecific(buf_key, tb)) {
+			free(tb);
+			return NULL;
+		}
+	}
+
+	if (tb->size < size) {
+		free(tb->ptr);
+		tb->size = 0;
+		if (p_memalign(&tb->ptr, size)) {
+			tb->ptr = NULL;
+			return NULL;
+		}
+		tb->size = size;
+	}
+
+	return tb->ptr;
+}
+
+// Copy len bytes from ifd at ipos to ofd at opos, or, if ifd is -1,
+// zero them. We let the kernel do it where possible, so the data doesn't
+// go through userspace, and, on filesystems supporting reflinks, is not
+// even copied. Otherwise, fall back to doing it via a per-thread buffer.
+int fill_range(struct plus_image *img, int ifd, off_t ipos,
+		int ofd, off_t opos, size_t len)
+{
+	u32 cluster = img->clusterSize;
+	void *buf = NULL;
+
+	if (!len) {
+		return 0;
+	}
+
+	if (ifd < 0) {
+		if (!fallocate(ofd, FALLOC_FL_ZERO_RANGE, opos, len)) {
+			return 0;
+		}
+		if (errno != EOPNOTSUPP) {
+			fprintf(stderr, "Error in fallocate: %m\n");
+			return -errno;
+		}
+		buf = get_thread_buf(cluster);
+		if (!buf) {
+			return -ENOMEM;
+		}
+		memset(buf, 0, MIN(len, cluster));
+	} else {
+		while (len > 0) {
+			ssize_t r = copy_file_range(ifd, &ipos, ofd, &opos,
+					len, 0);
+			if (r > 0) { // offsets are advanced by the kernel
+				len -= r;
+				continue;
+			}
+			if (r < 0 && errno != EXDEV && errno != EINVAL &&
+					errno != EOPNOTSUPP && errno != ENOSYS) {
+				fprintf(stderr, "Error in copy_file_range: %m\n");
+				return -errno;
+			}
+			break;
+		}
+	}
+
+	if (len && !buf) {
+		buf = get_thread_buf(cluster);
+		if (!buf) {
+			return -ENOMEM;
+		}
+	}
+	while (len > 0) {
+		size_t n = MIN(len, cluster);
+		if (ifd >= 0) {
+			int ret = read_block(ifd, buf, n, ipos);
+			if (ret) {
+				return ret;
+			}
+			ipos += n;
+		}
+		ssize_t r = pwrite(ofd, buf, n, opos);
+		if (r != (ssize_t)n) {
+			fprintf(stderr, "Error in pwrite: %m\n");
+			return r < 0 ? -errno : -EIO;
+		}
+		opos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Make a range of the top delta read as zeroes, freeing the disk space
+// where the filesystem can
+static int punch_range(struct plus_image *img, u32 blk, u32 off, u32 len)
+{
+	int wfd = img->fds[img->level];
+	off_t pos = (off_t)blk * img->clusterSize + off;
+
+	cache_invalidate(img->cache, img->level, blk);
+	if (!fallocate(wfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				pos, len)) {
+		return 0;
+	}
+	if (errno != EOPNOTSUPP) {
+		fprintf(stderr, "Error in fallocate: %m\n");
+		return -errno;
+	}
+
+	return fill_range(img, -1, 0, wfd, pos, len);
+}
+
+// Write to a cluster already in the top delta
+static int rewrite_cluster(struct plus_image *img, u32 idx, u32 blk,
+		u32 off, u32 len, const struct iovec *v, int nv, bool zero)
+{
+	int wfd = img->fds[img->level];
+
+	if (zero && len == img->clusterSize) {
+		// no need to write it out, nor to keep the space
+		TRACE(TR_ZERO, img->level, idx, blk, off, len);
+		return punch_range(img, blk, off, len);
+	}
+	TRACE(TR_REWRITE, img->level, idx, blk, off, len);
+
+	// offset in the delta file
+	off_t pos = (off_t)blk * img->clusterSize + off;
+	int ret = write_vec(wfd, v, nv, len, pos);
+	if (ret) {
+		return ret;
+	}
+	cache_invalidate(img->cache, img->level, blk);
+
+	return 0;
+}
+
+int write_new_cluster(struct plus_image *img, u32 idx, int lvl, u32 blk,
+		u32 off, u32 len, const struct iovec *v, int nv)
+{
+	u32 cluster = img->clusterSize;
+	int top_level = img->level;
+	int wfd = img->fds[top_level];
+	u32 newblk;
+	int ret;
+
+	// 1. Allocate a new cluster
+	ret = alloc_cluster(img, &newblk);
+	if (ret) {
+		return ret;
+	}
+	off_t newpos = (off_t)newblk * cluster;
+
+	// 2. Since this is a new cluster, we need to fill all
+	// of it. Parts not covered by this write are copied
+	// from the old cluster (if any), or zeroed.
+	u32 end = off + len;
+	if (len < cluster) {
+		int ifd = blk ? img->fds[lvl] : -1;
+		off_t opos = (off_t)blk * cluster;
+
+		ret = fill_range(img, ifd, opos, wfd, newpos, off);
+		if (ret) {
+			return ret;
+		}
+		ret = fill_range(img, ifd, opos + end,
+				wfd, newpos + end, cluster - end);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	// 3. Write the new data
+	TRACE(TR_ALLOC, top_level, idx, newblk, off, len);
+	if (!v) {
+		ret = fill_range(img, -1, 0, wfd, newpos + off, len);
+	} else {
+		ret = write_vec(wfd, v, nv, len, newpos + off);
+	}
+	if (ret) {
+		return ret;
+	}
+
+	// 4. Add a mapping to the internal table,
+	// so the new data can be read right away
+	ret = map_set(img, idx, top_level, newblk);
 	if (ret) {
 		return ret;
 	}
+
+	// 5. Queue the new BAT entry. It will be written
+	// by plus_flush(), after the data is on disk.
+	return bat_update(img, idx, newblk);
+}
+
+// Write size bytes at offset from the buffers, which are checked already
+static ssize_t write_iov(struct plus_image *img, const struct iovec *iov,
+		size_t size, off_t offset)
+{
+	int ret = 0;
+
+	TRACE(TR_WRITE, 0, offset / img->clusterSize, 0,
+			offset % img->clusterSize, size);
 	if (img->mode == O_RDONLY) {
 		return -EROFS;
 	}
 
+	// Keep the top delta from being switched while we write to it
+	write_begin(img);
+
 	u32 cluster = img->clusterSize;
 	size_t got = 0; // How much have we wrote so far
 	int top_level = img->level;
-	int wfd = img->fds[top_level];
-	u32 allocSize = img->allocSize;
+	struct iov_pos at = { iov, 0, 0 }; // where it comes from
+	struct iovec v[IOV_MAX];
 
 	while (got < size) {
 		// Cluster number, and offset within it
 		u32 idx = offset / cluster; // cluster number
 		u32 off = offset % cluster; // offset within the cluster
-		u32 len = MIN(cluster - off, size - got); // how much to write
-
-		int lvl = img->map_lvl[idx];
-		int blk = img->map_blk[idx];
-		if (blk && lvl == img->level) {
+		size_t len = MIN(cluster - off, size - got); // how much to write
+		int nv = iov_slice(&at, &len, v);
+
+		int lvl;
+		u32 blk;
+		map_get(img, idx, &lvl, &blk);
+		// Guests write lots of zeroes, which are cheaper not to write
+		bool zero = true;
+		for (int i = 0; i < nv && zero; i++) {
+			zero = is_zero(v[i].iov_base, v[i].iov_len);
+		}
+		if (blk && lvl == top_level) {
 			// top level, existing block, proceed with rewrite
-			printf("  W %5d -> %2d, %5d  off=%5d size=%5d\n",
-					idx, lvl, blk, off, len);
-
-			// offset in the delta file
-			off_t pos = blk * cluster + off;
-			printf("pwrite(%d, %p, %d, %zu) = ",
-					wfd, buf + got, len, pos);
-			ssize_t r = pwrite(wfd, buf + got, len, pos);
-			printf("%zd (%m)\n", r);
-			if (r != len) {
-				fprintf(stderr, "%s: error in pwrite(%d, %p, %d, %zu) = %zd: %m\n",
-						__func__, wfd, buf + got, len, pos, r);
-				if (r < 0) { // pwrite set errno
-					return -errno;
-				} else { // wtf just happened? return EIO
-					return -EIO;
-				}
-			}
-		} else { // Allocate a new cluster
-			void *wbuf = buf + got;
-
-			// 1. Grow image size by one cluster
-			printf("  G %5d\n", allocSize);
-			if (ftruncate(wfd, allocSize * cluster)) {
-				fprintf(stderr, "Error in ftruncate: %m\n");
-				ret = -errno;
-				goto err;
+			ret = rewrite_cluster(img, idx, blk, off, len, v, nv,
+					zero);
+		} else if (!blk && zero && !img->wb) {
+			// a hole reads as zeroes already
+			TRACE(TR_ZERO, lvl, idx, blk, off, len);
+		} else {
+			// Allocate a new cluster. Only one thread may do it
+			// for a given cluster, others wait and then rewrite it.
+			pthread_mutex_t *lock =
+				&img->cluster_locks[idx % NR_CLUSTER_LOCKS];
+			pthread_mutex_lock(lock);
+			map_get(img, idx, &lvl, &blk);
+			int staged;
+			if (blk && lvl == top_level) {
+				ret = rewrite_cluster(img, idx, blk, off, len,
+						v, nv, zero);
+			} else if (img->wb && (staged = wb_write(img, idx, blk,
+							off, len, v, nv,
+							zero))) {
+				ret = staged < 0 ? staged : 0;
+			} else if (!blk && zero) {
+				TRACE(TR_ZERO, lvl, idx, blk, off, len);
+			} else {
+				// zeroes over a lower level are only allocated
+				ret = write_new_cluster(img, idx, lvl, blk,
+						off, len, zero ? NULL : v, nv);
 			}
+			pthread_mutex_unlock(lock);
+		}
+		if (ret) {
+			break;
+		}
+		iov_advance(&at, len);
+		got += len;
+		offset += len;
+	}
+	write_end(img);
 
-			// 2. Prepare data to be written, note that since
-			// this is a new cluster we need to write a whole one
-			if (len < cluster) {
-				// partial write, need to reconstruct a cluster
-				wbuf = img->buf;
-				if (blk) {
-					// read the old data
-					ret = read_block(img->fds[lvl], wbuf,
-							cluster, blk * cluster);
-					if (ret) {
-						goto err;
-					}
-				} else {
-					// just zero out the data
-					memset(wbuf, 0, cluster);
-				}
+	// Note that if we fail to write a new cluster, it stays allocated
+	// but unused, as it never makes it to the BAT
+
+	return ret ? ret : (ssize_t)got;
+}
 
-				// copy the new data in
-				memcpy(wbuf + off, buf + got, len);
+// Read or write a range which is not page-aligned, or to or from a buffer
+// which is not. Whole pages of the range go right to the buffer where it
+// is aligned with them, the rest goes through bounce buffers. An edge
+// page which is written in part is read, modified and written back with
+// its page lock held, so that unaligned writes to the rest of it are not
+// lost meanwhile.
+static ssize_t unaligned_io(const char *func, struct plus_image *img,
+		bool write, size_t size, off_t offset, void *buf)
+{
+	// The image is whole clusters, so the edge pages are within it too
+	int ret = range_checks(func, img, size, offset);
+	if (ret) {
+		return ret;
+	}
+	if (write && img->mode == O_RDONLY) {
+		return -EROFS;
+	}
+
+	void *bounce = NULL;
+	size_t done = 0;
+	while (done < size) {
+		off_t pos = offset + done;
+		u32 in = pos % PAGE_SIZE; // offset within the page
+		size_t len = size - done;
+		struct iovec iov;
+		ssize_t r;
+
+		if (!in && len >= PAGE_SIZE && io_aligned(0, 0, buf + done)) {
+			// the buffer is aligned with the pages
+			iov.iov_base = buf + done;
+			iov.iov_len = len & ~(size_t)(PAGE_SIZE - 1);
+			r = write ? write_iov(img, &iov, iov.iov_len, pos) :
+				read_iov(img, &iov, iov.iov_len, pos);
+			if (r < 0) {
+				ret = r;
+				break;
 			}
+			done += iov.iov_len;
+			continue;
+		}
 
-			// 3. Write the cluster
-			printf("  W %5d -> %2d, %5d  off=%5d size=%5d\n",
-					idx, top_level, allocSize, allocSize*cluster, cluster);
-			ssize_t r = pwrite(wfd, wbuf, cluster, allocSize * cluster);
-			if (r != cluster) {
-				fprintf(stderr, "Error in pwrite: %m\n");
-				if (r < 0) {
-					ret = -errno;
-				} else {
-					ret = -EIO;
+		if (!bounce && !(bounce = bounce_get())) {
+			ret = -ENOMEM;
+			break;
+		}
+		iov.iov_base = bounce;
+		if (!in && len >= PAGE_SIZE) {
+			// whole pages, copied to or from the bounce buffer
+			len = MIN(len & ~(size_t)(PAGE_SIZE - 1), BOUNCE_SIZE);
+			iov.iov_len = len;
+			if (write) {
+				memcpy(bounce, buf + done, len);
+				r = write_iov(img, &iov, len, pos);
+			} else {
+				r = read_iov(img, &iov, len, pos);
+				if (r >= 0) {
+					memcpy(buf + done, bounce, len);
 				}
-				goto err;
 			}
+		} else {
+			// a part of an edge page
+			len = MIN(len, PAGE_SIZE - in);
+			iov.iov_len = PAGE_SIZE;
+			pthread_mutex_t *lock = write ? &img->page_locks[
+				(pos / PAGE_SIZE) % NR_PAGE_LOCKS] : NULL;
+			if (lock) {
+				pthread_mutex_lock(lock);
+			}
+			r = read_iov(img, &iov, PAGE_SIZE, pos - in);
+			if (r >= 0 && write) {
+				memcpy(bounce + in, buf + done, len);
+				r = write_iov(img, &iov, PAGE_SIZE, pos - in);
+			} else if (r >= 0) {
+				memcpy(buf + done, bounce + in, len);
+			}
+			if (lock) {
+				pthread_mutex_unlock(lock);
+			}
+		}
+		if (r < 0) {
+			ret = r;
+			break;
+		}
+		done += len;
+	}
+	if (bounce) {
+		bounce_put(bounce);
+	}
 
-			// FIXME: steps 4 and 5 need to be moved
-			// to after writing all the data.
+	return ret ? ret : (ssize_t)done;
+}
 
-			// 4. Add a BAT entry to internal table
-			img->map_lvl[idx] = top_level;
-			img->map_blk[idx] = allocSize;
+ssize_t plus_write(struct plus_image *img, size_t size, off_t offset, void *buf)
+{
+	if (!io_aligned(size, offset, buf)) {
+		return unaligned_io(__func__, img, true, size, offset, buf);
+	}
 
-			// 5. Write the new BAT entry
-			ret = write_bat_entry(img, idx, allocSize);
-			if (ret) {
-				goto err;
-			}
+	int ret = sanity_checks(__func__, img, size, offset, buf);
+	if (ret) {
+		return ret;
+	}
 
-			// 6. Update allocSize
-			allocSize++;
+	struct iovec iov = { buf, size };
+	return write_iov(img, &iov, size, offset);
+}
 
+ssize_t plus_writev(struct plus_image *img, const struct iovec *iov,
+		int iovcnt, off_t offset)
+{
+	size_t size;
+	int ret = iov_checks(__func__, img, iov, iovcnt, offset, &size);
+	if (ret) {
+		return ret;
+	}
+
+	return write_iov(img, iov, size, offset);
+}
+
+// Drop cluster idx from the top delta, so it's a hole again.
+// Called with the cluster lock held.
+static int free_cluster(struct plus_image *img, u32 idx, u32 blk)
+{
+	TRACE(TR_FREE, img->level, idx, blk, 0, img->clusterSize);
+	int ret = map_set(img, idx, 0, 0);
+	if (!ret) {
+		ret = bat_update(img, idx, 0);
+	}
+	if (ret) {
+		return ret;
+	}
+
+	// The data are gone anyway, so it's fine if we can't punch it
+	cache_invalidate(img->cache, img->level, blk);
+	if (fallocate(img->fds[img->level],
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				(off_t)blk * img->clusterSize,
+				img->clusterSize) && errno != EOPNOTSUPP) {
+		fprintf(stderr, "Error in fallocate: %m\n");
+	}
+
+	return 0;
+}
+
+// Let freed blocks be reused. Before that, writes that could still be
+// going to them must be done, and the BAT entries that pointed to them
+// must be cleared on disk.
+static void release_blocks(struct plus_image *img, int level,
+		const u32 *blks, u32 n)
+{
+	gate_freeze(img);
+	gate_thaw(img);
+	if (plus_flush(img)) {
+		// they are found to be free once the image is reopened
+		return;
+	}
+	// Reads might still be looking at them, or have put their old data
+	// in the cache
+	read_sync(img);
+	for (u32 i = 0; i < n; i++) {
+		cache_invalidate(img->cache, level, blks[i]);
+	}
+
+	pthread_mutex_lock(&img->alloc_lock);
+	// If there was a snapshot meanwhile, they belong to a lower level
+	if (img->level == level) {
+		for (u32 i = 0; i < n; i++) {
+			put_free(img, blks[i]);
+		}
+	}
+	pthread_mutex_unlock(&img->alloc_lock);
+}
+
+int plus_discard(struct plus_image *img, size_t size, off_t offset)
+{
+	int ret = sanity_checks(__func__, img, size, offset, NULL);
+	if (ret) {
+		return ret;
+	}
+	TRACE(TR_DISCARD, 0, offset / img->clusterSize, 0,
+			offset % img->clusterSize, size);
+	if (img->mode == O_RDONLY) {
+		return -EROFS;
+	}
+
+	u32 cluster = img->clusterSize;
+	u32 *freed = malloc((size / cluster + 1) * sizeof(*freed));
+	u32 nfreed = 0;
+	if (!freed) {
+		return -ENOMEM;
+	}
+
+	write_begin(img);
+	int top_level = img->level;
+	size_t got = 0;
+	while (got < size) {
+		u32 idx = offset / cluster;
+		u32 off = offset % cluster;
+		u32 len = MIN(cluster - off, size - got);
+
+		pthread_mutex_t *lock = &img->cluster_locks[idx % NR_CLUSTER_LOCKS];
+		pthread_mutex_lock(lock);
+		int lvl;
+		u32 blk;
+		// Staged data go first, so they are discarded as well
+		ret = img->wb ? wb_writeout(img, idx) : 0;
+		map_get(img, idx, &lvl, &blk);
+		if (ret) {
+			// staged data can't be written out
+		} else if (!blk) {
+			// a hole reads as zeroes already
+		} else if (lvl != top_level) {
+			// can't change a lower level, so override it
+			ret = write_new_cluster(img, idx, lvl, blk,
+					off, len, NULL, 0);
+		} else if (len == cluster &&
+				!(img->lower_map[idx / 8] & (1 << (idx % 8)))) {
+			ret = free_cluster(img, idx, blk);
+			if (!ret) {
+				freed[nfreed++] = blk;
+			}
+		} else {
+			// either partial, or a hole would show the lower level
+			ret = punch_range(img, blk, off, len);
+		}
+		pthread_mutex_unlock(lock);
+		if (ret) {
+			break;
 		}
 		got += len;
 		offset += len;
 	}
+	write_end(img);
 
-	// All data written successfully, need to write metadata
-	if (allocSize > img->allocSize) {
-		// Update the size
-		img->allocSize = allocSize;
+	if (nfreed) {
+		release_blocks(img, top_level, freed, nfreed);
 	}
+	free(freed);
+
+	return ret;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Create an empty delta, with the same header as the top one
+static int create_delta(struct plus_image *img, const char *name)
+{
+	int fd = open(name, O_RDWR|O_CREAT|O_EXCL|O_DIRECT, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Can't create \"%s\": %m\n", name);
+		return -1;
+	}
+
+	void *hdr;
+	if (p_memalign(&hdr, PAGE_SIZE)) {
+		goto err;
+	}
+	memset(hdr, 0, PAGE_SIZE);
+	memcpy(hdr, img->wbat, sizeof(struct ploop_pvd_header));
+	((struct ploop_pvd_header *)hdr)->m_DiskInUse = 0;
+
+	// The BAT is all zeroes, i.e. empty
+	size_t len = (size_t)img->batSize * img->clusterSize;
+	ssize_t r = -1;
+	if (!ftruncate(fd, len)) {
+		r = pwrite(fd, hdr, PAGE_SIZE, 0);
+	}
+	free(hdr);
+	if (r != PAGE_SIZE || fsync(fd)) {
+		fprintf(stderr, "Can't write \"%s\": %m\n", name);
+		goto err;
+	}
+
+	return fd;
 
-	return got;
 err:
-	if (allocSize > img->allocSize) {
-		// FIXME how to undo the mapping?
+	close(fd);
+	unlink(name);
+	return -1;
+}
 
-		// ftruncate back to old size
-		if (ftruncate(wfd, img->allocSize * cluster)) {
-			fprintf(stderr, "Error in ftruncate: %m\n");
-			// we already have a (more serious) error,
-			// so don't overwrite its code
+int plus_snapshot(struct plus_image *img, const char *delta)
+{
+	if (!img) {
+		return -EBADF;
+	}
+	if (img->mode == O_RDONLY) {
+		return -EROFS;
+	}
+
+	pthread_mutex_lock(&img->level_lock);
+
+	// Do all the slow parts before holding off writes
+	int level = img->level + 1;
+	size_t len = (size_t)img->batSize * img->clusterSize;
+	void *wbat = MAP_FAILED;
+	int *fds = malloc((level + 1) * sizeof(*fds));
+	struct shared_delta **shared = calloc(level + 1, sizeof(*shared));
+	u8 *merged = calloc(level + 1, sizeof(*merged));
+	int ret = -ENOMEM;
+	if (!fds || !shared || !merged) {
+		goto err;
+	}
+
+	int fd = create_delta(img, delta);
+	if (fd < 0) {
+		ret = -EIO;
+		goto err;
+	}
+	wbat = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (wbat == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed: %m\n", __func__);
+		close(fd);
+		unlink(delta);
+		goto err;
+	}
+	mark_in_use(wbat, true);
+
+	// Most of the staged data can be written out before holding off
+	// writes, the rest of it is part of the image being preserved
+	if (img->wb) {
+		write_begin(img);
+		wb_flush(img);
+		write_end(img);
+	}
+
+	// Now switch the top delta
+	u64 t = now_ns();
+	gate_freeze(img);
+	ret = wb_flush(img);
+	pthread_mutex_lock(&img->bat_lock);
+	if (!ret) {
+		trim_prealloc(img);
+		ret = flush_locked(img);
+	}
+	if (ret) {
+		pthread_mutex_unlock(&img->bat_lock);
+		gate_thaw(img);
+		munmap(wbat, len);
+		close(fd);
+		unlink(delta);
+		goto err;
+	}
+	// Whatever the old top has is below the new one
+	const u32 *obat = img->wbat;
+	u32 n = img->batSize * (img->clusterSize / 4);
+	for (u32 i = HDR_SIZE_32; (i = next_entry(obat, i, n)) < n; i++) {
+		u32 idx = i - HDR_SIZE_32;
+		if (idx < img->bdevSize) {
+			img->lower_map[idx / 8] |= 1 << (idx % 8);
 		}
 	}
+	mark_in_use(img->wbat, false);
+	munmap(img->wbat, len);
+	img->wbat = wbat;
+	img->allocSize = img->preallocSize = img->batSize;
+
+	// Readers might be using the old arrays, so they are kept around
+	int *ofds = img->fds;
+	struct shared_delta **oshared = img->shared;
+	u8 *omerged = img->merged;
+	memcpy(fds, ofds, level * sizeof(*fds));
+	memcpy(shared, oshared, level * sizeof(*shared));
+	memcpy(merged, omerged, level * sizeof(*merged));
+	fds[level] = fd;
+	__atomic_store_n(&img->fds, fds, __ATOMIC_RELEASE);
+	__atomic_store_n(&img->shared, shared, __ATOMIC_RELEASE);
+	img->merged = merged;
+	img->max_levels = level + 1;
+	__atomic_store_n(&img->level, level, __ATOMIC_RELEASE);
+	// The new top has no free blocks
+	pthread_mutex_lock(&img->alloc_lock);
+	memset(img->free_map, 0, img->free_bits / 8);
+	img->nfree = 0;
+	img->free_hint = 0;
+	pthread_mutex_unlock(&img->alloc_lock);
+
+	pthread_mutex_unlock(&img->bat_lock);
+	gate_thaw(img);
+	TRACE(TR_SNAPSHOT, level, 0, 0, 0, now_ns() - t);
+
+	map_retire(img, ofds);
+	map_retire(img, oshared);
+	map_retire(img, omerged);
+	pthread_mutex_unlock(&img->level_lock);
 
+	return 0;
+
+err:
+	free(fds);
+	free(shared);
+	free(merged);
+	pthread_mutex_unlock(&img->level_lock);
 	return ret;
 }
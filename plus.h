@@ -2,6 +2,9 @@
 #define _PLUS_H_
 
 #include <stdint.h>
+#include <pthread.h>
+
+struct iovec;
 
 typedef uint64_t	u64;
 typedef uint32_t	u32;
@@ -18,22 +21,229 @@ struct plus_image {
 	u32 batSize;	// size of BAT maps, in cluster blocks
 	u32 bdevSize;	// size of block device, in cluster blocks
 	u32 allocSize;	// size of allocated image file
+	u32 preallocSize; // allocSize plus the preallocated unused tail
+	u32 preallocChunk; // clusters to preallocate at once, can be changed
 	void *wbat;	// mmap()'ed metadata (for writing)
 	u32 max_idx;	// max number of entries in BAT table
 
-	// per-cluster_block mappings, indexed by cluster number
-	u8  *map_lvl;	// block -> level mapping
-	u32 *map_blk;	// block -> block mapping
+	// BAT updates not yet written to disk, see plus_flush()
+	u32 *dirty_idx;	// cluster number
+	u32 *dirty_blk;	// block in the top delta
+	u32 ndirty;	// number of pending updates
+	u8  *dirty_pages; // bitmap of modified BAT pages
+
+	// Free blocks of the top delta, reused by new clusters before
+	// growing it, see plus_discard(). Under alloc_lock.
+	u64 *free_map;	// bitmap of free blocks
+	u32 free_bits;	// size of free_map, in bits
+	u32 nfree;	// number of free blocks
+	u32 free_hint;	// there are no free blocks below this one
+	u8  *lower_map;	// bitmap of clusters lower levels have data for
+
+	// combined block -> (level, block) map, see plus-map.c
+	struct map_chunk *map;
+	u32 nchunks;	// number of map chunks
+	void *retired;	// replaced map arrays, see plus-map.c
+
+	// Locking, so the image can be used by many threads at once.
+	// Reads take no locks.
+	pthread_mutex_t alloc_lock;	// growing the top delta
+	pthread_mutex_t bat_lock;	// wbat, dirty_*
+	pthread_mutex_t map_lock;	// map updates
+	pthread_mutex_t *cluster_locks;	// cluster allocation, hashed by index
+	pthread_mutex_t *page_locks;	// unaligned writes, hashed by page
+	pthread_mutex_t level_lock;	// plus_merge(), plus_snapshot()
+
+	// Writes in progress, which plus_snapshot() and plus_discard()
+	// wait for
+	u32 writers;
+	int frozen;	// no new writes while non-zero
+	pthread_mutex_t gate_lock;
+	pthread_cond_t gate_cond;
+
+	// Reads in progress, by the parity of the epoch they began in,
+	// which plus_discard() waits out before reusing freed blocks
+	u32 epoch;
+	u32 readers[2];
+	pthread_mutex_t epoch_lock;	// one wait at a time
+
+	struct plus_cache *cache;	// cluster cache, see plus-cache.c
+	struct plus_mmap *mmap;		// mapped read-only deltas, see plus-mmap.c
+	struct plus_ra *ra;		// readahead, see plus-ra.c
+	struct plus_wb *wb;		// staged writes, see plus-wb.c
+	u32 rings;			// number of open rings, see plus-uring.c
 
-	// per-level arrays, size is max_levels
+	// per-level arrays, size is max_levels; replaced by plus_snapshot()
 	int *fds;	// opened delta file descriptors
+	struct shared_delta **shared; // shared deltas (in host mode), or NULL
+	u8 *merged;	// set once merged into the level below
 
-	void *buf;	// page-aligned cluster size buffer
+	void *buf;	// page-aligned cluster size buffer, used by plus_open()
 };
 
 struct plus_image *plus_open(int count, char **deltas, int mode);
 int plus_close(struct plus_image *img);
+// Read or write size bytes at offset. These are fastest with buf, size
+// and offset all page-aligned; anything else is done through bounce
+// buffers, reading (and for writes, writing back) whole pages at the
+// edges of the range, and copying where buf is misaligned with it.
 ssize_t plus_read(struct plus_image *img, size_t size, off_t offset, void *buf);
 ssize_t plus_write(struct plus_image *img, size_t size, off_t offset, void *buf);
+// Same, for data scattered over iovcnt buffers, each of them page-aligned
+// and a multiple of the page size long. The buffers are handed right
+// to preadv()/pwritev() on the deltas, including when a partially
+// written cluster is copied to the top delta, so there is no need to
+// gather them into a single buffer first.
+ssize_t plus_readv(struct plus_image *img, const struct iovec *iov,
+		int iovcnt, off_t offset);
+ssize_t plus_writev(struct plus_image *img, const struct iovec *iov,
+		int iovcnt, off_t offset);
+// Make everything written so far durable. New clusters only become
+// part of the on-disk BAT here, after their data are synced.
+int plus_flush(struct plus_image *img);
+
+// Discard [offset, offset + size), so that it reads as zeroes. Clusters
+// which are entirely discarded and only exist in the top delta are freed,
+// and their blocks are reused by later writes; the rest of the range is
+// zeroed, punching holes in the top delta where possible. Like
+// plus_snapshot(), waits for writes in flight on all the rings, and
+// before reusing the freed blocks, for reads (on the rings, too) which
+// might still be looking at them. Note that extents of the top delta
+// found by plus_map_extents() may be reused for other data once
+// plus_discard() returns.
+int plus_discard(struct plus_image *img, size_t size, off_t offset);
+
+// Create a new empty delta, and make it the top one, so the current
+// top delta becomes read-only, preserving the image as it is now. Writes
+// are held off while the top is switched, which is only for as long as
+// it takes to write out pending BAT updates. Note that it also waits for
+// the writes in flight on all the rings, so those must keep being
+// completed by plus_ring_wait() meanwhile.
+int plus_snapshot(struct plus_image *img, const char *delta);
+
+// Merge delta at a given level into the one below it, while the image
+// is in use. Any level but the base and the top one can be merged; once
+// done, the merged delta is no longer needed. It is kept open until
+// plus_close() though, and the levels keep their numbers.
+int plus_merge(struct plus_image *img, int level);
+
+// A contiguous piece of the image, which is either a hole,
+// or is stored contiguously in a single delta
+struct plus_extent {
+	off_t offset;	// offset in the image
+	size_t len;	// length, in bytes
+	int level;	// delta level, or -1 for a hole
+	off_t pos;	// offset in the delta file (if not a hole)
+};
+
+// Find out where the data for [offset, offset + len) lives. Fills in
+// up to max extents, returns the number of extents filled, or -errno.
+// If the return value is max, there might be more extents to follow.
+int plus_map_extents(struct plus_image *img, off_t offset, size_t len,
+		struct plus_extent *ext, int max);
+
+// Changed block tracking. Same as plus_map_extents(), but only fills in
+// the extents living in the levels above base, i.e. what was written
+// since base was the top delta (everything, if base is -1), skipping the
+// rest. Returns the number of extents filled, or -errno; if it is max,
+// there might be more after the last one. Note that once a level above
+// base is merged into base or below, its changes are no longer seen.
+int plus_changed_extents(struct plus_image *img, int base, off_t offset,
+		size_t len, struct plus_extent *ext, int max);
+
+// Cluster cache. Deltas are opened with O_DIRECT, so by default nothing
+// is cached. This sets up a cache of a given size in bytes, or removes
+// it if size is 0. Must not be called while there is I/O in progress.
+int plus_cache_setup(struct plus_image *img, size_t size);
+
+struct plus_cache_stats {
+	u64 hits;
+	u64 misses;
+	u64 ghost_hits;	// misses of recently evicted clusters
+	u64 evictions;
+	u64 invalidations;
+	u64 size;	// bytes in use
+	u64 prefetched;	// clusters read ahead
+	u64 prefetch_hits; // hits of clusters read ahead
+};
+
+void plus_cache_stats(struct plus_image *img, struct plus_cache_stats *st);
+
+// Write-back staging. Writes of less than a cluster to clusters not yet
+// in the top delta are kept in memory, up to size bytes worth of
+// clusters, and merged, so that each cluster is written out once: when
+// all of it is written, or to make room for others, or once it has been
+// staged for max_age_ms, or by plus_flush(). Reads see the staged data,
+// but plus_map_extents() and rings don't, so it can't be used along
+// with rings (fails with -EBUSY while any are open), and plus_flush()
+// has to be done before mapping extents. Turned off (writing out
+// everything) if size is 0. Must not be called while there is I/O in
+// progress.
+int plus_writeback_setup(struct plus_image *img, size_t size,
+		unsigned max_age_ms);
+
+// Readahead. With O_DIRECT, there is none by default. This watches
+// plus_read() for sequential and strided streams of reads, and has
+// nthreads threads read the clusters they are about to need into the
+// cluster cache, so the levels read without a cache (or via mmap) are
+// not read ahead. The window starts small and grows up to max_window
+// bytes per stream, and shrinks if the data read ahead is not used.
+// Fails with -EINVAL if there is no cache to read into, so the cache has
+// to be set up first. Turned off if nthreads is 0. Must not be called
+// while there is I/O in progress.
+int plus_readahead_setup(struct plus_image *img, int nthreads,
+		size_t max_window);
+
+// Memory-mapped reads. Read-only deltas (all but the top one, unless the
+// image is opened read-only) are mapped into memory, and read through
+// the page cache rather than with O_DIRECT. Turned off if on is 0.
+// Must not be called while there is I/O in progress. Deltas that become
+// read-only later on, by plus_snapshot(), are not mapped until it is
+// called again.
+int plus_mmap_setup(struct plus_image *img, int on);
+
+// Zero-copy read, with mapped deltas. Rather than copying the data,
+// points up to *niov entries of iov right at the mappings (or at zeroes,
+// for holes), and sets *niov to the number of entries used. The data
+// stays there while the image is open. Returns the number of bytes
+// covered, which is less than size if iov is full, or if the data that
+// follows is not mapped (i.e. is in the top delta); or -errno.
+ssize_t plus_read_map(struct plus_image *img, size_t size, off_t offset,
+		struct iovec *iov, int *niov);
+
+// Host mode. From now on, read-only deltas opened by plus_open() are
+// shared between all the images using them in this process: each is
+// only opened and mapped once, and has a single cluster cache of
+// cache_size bytes (0 for none), instead of one per image.
+int plus_host_setup(size_t cache_size);
+// Sum of the stats of the shared deltas' caches
+void plus_host_stats(struct plus_cache_stats *st);
+
+// Asynchronous I/O, backed by io_uring
+
+struct plus_ring;
+
+// Request completion callback, ret is request size on success, or -errno
+typedef void (*plus_io_cb)(ssize_t ret, void *priv);
+
+// Set up a ring of a given depth for an opened image. Buffers given in
+// bufs (can be NULL) are registered with the kernel, making I/O to and
+// from them cheaper.
+struct plus_ring *plus_ring_open(struct plus_image *img, unsigned depth,
+		const struct iovec *bufs, unsigned nbufs);
+// Waits for all the requests in flight, then frees the ring
+void plus_ring_close(struct plus_ring *ring);
+// Queue a request. Returns 0 if queued, in which case cb will be called
+// from plus_ring_wait() once it is done, or -errno. A write to a new
+// cluster holds its cluster lock until it is done, so the thread using
+// the ring must not plus_write() meanwhile.
+int plus_submit_read(struct plus_ring *ring, size_t size, off_t offset,
+		void *buf, plus_io_cb cb, void *priv);
+int plus_submit_write(struct plus_ring *ring, size_t size, off_t offset,
+		void *buf, plus_io_cb cb, void *priv);
+// Submit queued requests, wait for at least min_complete of them
+// to complete, and run their callbacks. Returns the number of
+// completed requests, or -errno.
+int plus_ring_wait(struct plus_ring *ring, unsigned min_complete);
 
 #endif // _PLUS_H_
@@ -5,56 +5,346 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "plus.h"
 
+// Export of an image into a raw file, or to stdout.
+//
+// The image is split into chunks, which are handled by a number of
+// threads at once. Holes are skipped, so the output file stays sparse,
+// and the data are copied by the kernel right from the deltas, with
+// copy_file_range(), or else read with plus_read(). If the output is not
+// seekable (i.e. a pipe), chunks are read in parallel but written out in
+// order, holes included.
+
+// Size of a chunk, also the size of a per-thread buffer
+#define CHUNK_SIZE	(8U << 20)
+#define MAX_THREADS	16
+
+struct export {
+	struct plus_image *img;
+	int fd;		// output
+	int stream;	// output is not seekable
+	off_t size;	// image size
+	u64 nchunks;
+	u64 next;	// next chunk to take
+	u64 out;	// next chunk to write out, if stream
+	int no_copy;	// copy_file_range() doesn't work here
+	int ret;	// first error
+	u64 copied;	// bytes of data exported
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
 static const char *self; // argv[0]
 
 static void usage(int x)
 {
-	printf("Usage: %s BASE_DELTA ... TOP_DELTA\n", basename(self));
+	printf("Usage: %s [-o OUTPUT] [-t THREADS] BASE_DELTA ... TOP_DELTA\n",
+			basename(self));
+	printf("Exports an image into a raw file\n");
+	printf("  -o OUTPUT	-- output file (default outfile), - for stdout\n");
+	printf("  -t THREADS	-- number of threads (default: one per CPU, "
+			"up to %d)\n", MAX_THREADS);
 	exit(x);
 }
 
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_error(struct export *e, int ret)
+{
+	pthread_mutex_lock(&e->lock);
+	if (!e->ret) {
+		e->ret = ret;
+	}
+	// in case someone waits for us to write out our chunk
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t pos)
+{
+	while (len > 0) {
+		ssize_t r = pos < 0 ? write(fd, buf, len) :
+			pwrite(fd, buf, len, pos);
+		if (r < 0) {
+			fprintf(stderr, "Error writing output: %m\n");
+			return -errno;
+		}
+		buf += r;
+		len -= r;
+		if (pos >= 0) {
+			pos += r;
+		}
+	}
+
+	return 0;
+}
+
+// Read a part of the image and write it to the same place in the output
+static int read_range(struct export *e, off_t off, size_t len, void *buf)
+{
+	while (len > 0) {
+		size_t n = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+		ssize_t r = plus_read(e->img, n, off, buf);
+		if (r != (ssize_t)n) {
+			fprintf(stderr, "plus_read: %zd\n", r);
+			return r < 0 ? r : -EIO;
+		}
+		int ret = write_all(e->fd, buf, n, off);
+		if (ret) {
+			return ret;
+		}
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Copy an extent of data to the output, by the kernel if it can
+static int copy_extent(struct export *e, const struct plus_extent *ext,
+		void *buf)
+{
+	int ifd = e->img->fds[ext->level];
+	off_t ipos = ext->pos;
+	off_t opos = ext->offset;
+	size_t len = ext->len;
+
+	while (len > 0 && !__atomic_load_n(&e->no_copy, __ATOMIC_RELAXED)) {
+		ssize_t r = copy_file_range(ifd, &ipos, e->fd, &opos, len, 0);
+		if (r > 0) { // offsets are advanced by the kernel
+			len -= r;
+			continue;
+		}
+		if (r < 0 && errno != EXDEV && errno != EINVAL &&
+				errno != EOPNOTSUPP && errno != ENOSYS) {
+			fprintf(stderr, "Error in copy_file_range: %m\n");
+			return -errno;
+		}
+		// not supported, don't try again
+		__atomic_store_n(&e->no_copy, 1, __ATOMIC_RELAXED);
+	}
+
+	return read_range(e, opos, len, buf);
+}
+
+// Export a chunk to a seekable output, skipping the holes
+static int export_sparse(struct export *e, off_t off, size_t len, void *buf)
+{
+	struct plus_extent ext[64];
+
+	while (len > 0) {
+		int n = plus_map_extents(e->img, off, len,
+				ext, sizeof(ext) / sizeof(ext[0]));
+		if (n <= 0) {
+			fprintf(stderr, "plus_map_extents: %d\n", n);
+			return n < 0 ? n : -EIO;
+		}
+		for (int i = 0; i < n; i++) {
+			if (ext[i].level < 0) {
+				continue;
+			}
+			int ret = copy_extent(e, &ext[i], buf);
+			if (ret) {
+				return ret;
+			}
+			__atomic_add_fetch(&e->copied, ext[i].len,
+					__ATOMIC_RELAXED);
+		}
+		off_t end = ext[n - 1].offset + ext[n - 1].len;
+		len -= end - off;
+		off = end;
+	}
+
+	return 0;
+}
+
+// Export chunk c to a stream, once all the chunks before it are written.
+// The chunk is read into memory rather than spliced from the deltas, as
+// chunks are read in parallel but written in order, so they have to be
+// held somewhere meanwhile.
+static int export_stream(struct export *e, u64 c, off_t off, size_t len,
+		void *buf)
+{
+	ssize_t r = plus_read(e->img, len, off, buf);
+	if (r != (ssize_t)len) {
+		fprintf(stderr, "plus_read: %zd\n", r);
+		return r < 0 ? r : -EIO;
+	}
+
+	pthread_mutex_lock(&e->lock);
+	while (e->out != c && !e->ret) {
+		pthread_cond_wait(&e->cond, &e->lock);
+	}
+	pthread_mutex_unlock(&e->lock);
+	if (e->ret) {
+		return e->ret;
+	}
+
+	int ret = write_all(e->fd, buf, len, -1);
+	if (!ret) {
+		__atomic_add_fetch(&e->copied, len, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&e->lock);
+		e->out++;
+		pthread_cond_broadcast(&e->cond);
+		pthread_mutex_unlock(&e->lock);
+	}
+
+	return ret;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct export *e = arg;
+	void *buf;
+	u64 c;
+
+	if (posix_memalign(&buf, 4096, CHUNK_SIZE)) {
+		set_error(e, -ENOMEM);
+		return NULL;
+	}
+
+	while ((c = __atomic_fetch_add(&e->next, 1, __ATOMIC_RELAXED)) <
+			e->nchunks) {
+		if (__atomic_load_n(&e->ret, __ATOMIC_RELAXED)) {
+			break;
+		}
+		off_t off = (off_t)c * CHUNK_SIZE;
+		size_t len = e->size - off < CHUNK_SIZE ?
+			e->size - off : CHUNK_SIZE;
+		int ret = e->stream ? export_stream(e, c, off, len, buf) :
+			export_sparse(e, off, len, buf);
+		if (ret) {
+			set_error(e, ret);
+			break;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
 int main(int argc, char **argv)
 {
-	struct plus_image *img;
+	const char *output = "outfile";
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
 	self = argv[0];
-	argv++; argc--;
+	while ((opt = getopt(argc, argv, "+o:t:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				fprintf(stderr, "Error: invalid number "
+						"of threads: %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	argv += optind; argc -= optind;
 
 	if (argc < 1) {
 		fprintf(stderr, "Error: invalid number of arguments\n");
 		usage(1);
 	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	if (nthreads > MAX_THREADS) {
+		nthreads = MAX_THREADS;
+	}
 
-	img = plus_open(argc, argv, O_RDONLY);
-	if (img == NULL)
+	struct export e = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	if (strcmp(output, "-") == 0) {
+		// The data go to stdout, and whatever is printed to stderr
+		e.fd = dup(1);
+		if (e.fd < 0 || dup2(2, 1) < 0) {
+			perror("dup");
+			return 1;
+		}
+	} else {
+		e.fd = open(output, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+		if (e.fd < 0) {
+			fprintf(stderr, "Can't open %s: %m\n", output);
+			return 1;
+		}
+	}
+	struct stat st;
+	if (fstat(e.fd, &st)) {
+		perror("stat");
 		return 1;
+	}
+	e.stream = !S_ISREG(st.st_mode);
 
-	size_t size = (size_t)img->clusterSize * img ->bdevSize;
-	int fd = open("outfile", O_RDWR|O_CREAT|O_TRUNC|O_DIRECT, 0600);
-	if (fd < 0) {
-		perror("creat");
+	e.img = plus_open(argc, argv, O_RDONLY);
+	fflush(stdout);
+	if (e.img == NULL) {
 		return 1;
 	}
-	if (ftruncate(fd, size)) {
+	e.size = (off_t)e.img->clusterSize * e.img->bdevSize;
+	e.nchunks = (e.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	if (!e.stream && ftruncate(e.fd, e.size)) {
 		perror("ftruncate");
 		return 1;
 	}
 
-	void *map = mmap(0, size, PROT_WRITE, MAP_SHARED, fd, 0);
-	if (map == MAP_FAILED) {
-		perror("mmap");
-		return 1;
+	double t = now();
+	pthread_t threads[MAX_THREADS];
+	long started = 0;
+	for (long i = 0; i < nthreads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, worker_fn, &e)) {
+			// the rest will do
+			break;
+		}
+		started++;
+	}
+	worker_fn(&e);
+	for (long i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
 	}
+	t = now() - t;
 
-	// Read it!
-	printf("read = %zd\n", plus_read(img, size, 0, map));
+	if (!e.ret && !e.stream && fsync(e.fd)) {
+		perror("fsync");
+		e.ret = -errno;
+	}
+	if (close(e.fd) && !e.ret) {
+		perror("close");
+		e.ret = -errno;
+	}
+	plus_close(e.img);
+	if (e.ret) {
+		fprintf(stderr, "Export failed: %s\n", strerror(-e.ret));
+		return 1;
+	}
 
-	printf("closing...\n");
-	close(fd);
-	plus_close(img);
+	fprintf(stderr, "Exported %llu of %llu bytes in %.2f s, %ld threads\n",
+			(unsigned long long)e.copied,
+			(unsigned long long)e.size, t, started + 1);
 
 	return 0;
 }
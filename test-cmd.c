@@ -6,11 +6,160 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
 
 #include "plus.h"
 
 static const char *self; // argv[0]
 
+// Async I/O state
+static struct plus_ring *ring;
+static unsigned ring_depth;
+static ssize_t ring_ret;
+
+static size_t cache_size;
+static int use_mmap;
+static int use_vec;
+static int ra_threads;
+static size_t ra_window;
+static size_t wb_size;
+static unsigned wb_age;
+
+static void ring_cb(ssize_t ret, void *priv)
+{
+	size_t size = (size_t)priv;
+
+	if (ret != (ssize_t)size && ring_ret >= 0) {
+		ring_ret = ret < 0 ? ret : -EIO;
+	}
+}
+
+// Do I/O asynchronously, as a number of cluster-sized requests
+// submitted all at once
+static ssize_t ring_io(struct plus_image *img, int write,
+		size_t size, off_t offset, void *buf)
+{
+	u32 cluster = img->clusterSize;
+	size_t done = 0;
+	int pending = 0;
+
+	ring_ret = 0;
+	while (done < size) {
+		size_t len = cluster - (offset + done) % cluster;
+		if (len > size - done) {
+			len = size - done;
+		}
+		int ret = write ?
+			plus_submit_write(ring, len, offset + done,
+					buf + done, ring_cb, (void *)len) :
+			plus_submit_read(ring, len, offset + done,
+					buf + done, ring_cb, (void *)len);
+		if (ret) {
+			ring_ret = ret;
+			break;
+		}
+		pending++;
+		done += len;
+	}
+
+	while (pending > 0) {
+		int ret = plus_ring_wait(ring, pending);
+		if (ret < 0) {
+			return ret;
+		}
+		pending -= ret;
+	}
+
+	return ring_ret < 0 ? ring_ret : (ssize_t)done;
+}
+
+// Read via plus_read_map() as much as it gives, the rest via plus_read()
+static ssize_t map_read(struct plus_image *img, size_t size, off_t offset,
+		void *buf)
+{
+	struct iovec iov[16];
+	size_t done = 0;
+
+	while (done < size) {
+		int n = sizeof(iov) / sizeof(iov[0]);
+		ssize_t r = plus_read_map(img, size - done, offset + done,
+				iov, &n);
+		if (r < 0) {
+			return r;
+		}
+		for (int i = 0; i < n; i++) {
+			memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+			done += iov[i].iov_len;
+		}
+		if (n == 0) {
+			// not mapped
+			size_t len = size - done;
+			if (len > img->clusterSize) {
+				len = img->clusterSize;
+			}
+			r = plus_read(img, len, offset + done, buf + done);
+			if (r < 0) {
+				return r;
+			}
+			done += r;
+		}
+	}
+
+	return done;
+}
+
+// Do I/O via plus_readv()/plus_writev(), with the pages of buf
+// scattered over a separate buffer in reverse order
+static ssize_t vec_io(struct plus_image *img, int write,
+		size_t size, off_t offset, void *buf)
+{
+	if (size % 4096) {
+		fprintf(stderr, "vectored I/O is done in whole pages\n");
+		return -EINVAL;
+	}
+	size_t n = size / 4096;
+	struct iovec *iov = calloc(n ? n : 1, sizeof(*iov));
+	void *pages = NULL;
+	if (!iov || posix_memalign(&pages, 4096, size ? size : 4096)) {
+		free(iov);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		iov[i].iov_base = pages + (n - 1 - i) * 4096;
+		iov[i].iov_len = 4096;
+		if (write) {
+			memcpy(iov[i].iov_base, buf + i * 4096, 4096);
+		}
+	}
+	ssize_t ret = write ? plus_writev(img, iov, n, offset) :
+		plus_readv(img, iov, n, offset);
+	for (size_t i = 0; i < n && !write && ret > 0; i++) {
+		memcpy(buf + i * 4096, iov[i].iov_base, 4096);
+	}
+
+	free(pages);
+	free(iov);
+	return ret;
+}
+
+// Read or write the image the way the commands so far have set up
+static ssize_t image_io(struct plus_image *img, int write,
+		size_t size, off_t offset, void *buf)
+{
+	if (ring) {
+		return ring_io(img, write, size, offset, buf);
+	}
+	if (write) {
+		return use_vec ? vec_io(img, 1, size, offset, buf) :
+			plus_write(img, size, offset, buf);
+	}
+	return use_mmap ? map_read(img, size, offset, buf) :
+		use_vec ? vec_io(img, 0, size, offset, buf) :
+		plus_read(img, size, offset, buf);
+}
+
 static void usage(int x)
 {
 	printf("Usage: %s CMDFILE\n", basename(self));
@@ -21,7 +170,28 @@ static void usage(int x)
 	printf("			   MODE is one of r, rw, w\n");
 	printf("read OFFSET SIZE FILE	-- read a block of data\n");
 	printf("write OFFSET SIZE FILE	-- write a block of data\n");
+	printf("verify OFFSET SIZE FILE [FILE_OFFSET]\n");
+	printf("			-- read a block of data, and check that\n");
+	printf("			   it is the same as in FILE\n");
+	printf("extent OFFSET LEVEL POS	-- check that the data at OFFSET live\n");
+	printf("			   at POS of delta LEVEL (-1 for a hole)\n");
+	printf("discard OFFSET SIZE	-- discard a block of data\n");
+	printf("flush			-- make written data durable\n");
 	printf("close			-- close the set\n");
+	printf("ring DEPTH		-- use async I/O with a given queue\n");
+	printf("			   depth for reads and writes, 0 to disable\n");
+	printf("cache SIZE		-- use a cluster cache of SIZE bytes\n");
+	printf("stats			-- print cache statistics\n");
+	printf("mmap on|off		-- read lower deltas via mmap\n");
+	printf("vectored on|off		-- read and write page by page, via\n");
+	printf("			   plus_readv() and plus_writev()\n");
+	printf("readahead THREADS SIZE	-- read ahead up to SIZE bytes into\n");
+	printf("			   the cache (which needs to be set up),\n");
+	printf("			   0 threads to disable\n");
+	printf("writeback SIZE AGE_MS	-- stage partial writes in up to SIZE\n");
+	printf("			   bytes of memory, for up to AGE_MS\n");
+	printf("merge LEVEL		-- merge a delta into the one below\n");
+	printf("snapshot DELTA		-- create a new top delta\n");
 	printf("# ....			-- a comment (ignored)\n");
 	exit(x);
 }
@@ -96,6 +266,37 @@ int main(int argc, char **argv)
 				ret = 1;
 				goto out;
 			}
+			if (cache_size && plus_cache_setup(img, cache_size)) {
+				fprintf(stderr, "Can't set up cache\n");
+				ret = 1;
+				goto out;
+			}
+			if (use_mmap && plus_mmap_setup(img, 1)) {
+				fprintf(stderr, "Can't set up mmap\n");
+				ret = 1;
+				goto out;
+			}
+			if (ra_threads && plus_readahead_setup(img,
+						ra_threads, ra_window)) {
+				fprintf(stderr, "Can't set up readahead\n");
+				ret = 1;
+				goto out;
+			}
+			if (wb_size && plus_writeback_setup(img, wb_size,
+						wb_age)) {
+				fprintf(stderr, "Can't set up write-back "
+						"staging\n");
+				ret = 1;
+				goto out;
+			}
+			if (ring_depth) {
+				ring = plus_ring_open(img, ring_depth, NULL, 0);
+				if (!ring) {
+					fprintf(stderr, "Can't set up async I/O\n");
+					ret = 1;
+					goto out;
+				}
+			}
 		} else if (strncmp(cmd, "read ", 5) == 0) {
 			if (!img) {
 				fprintf(stderr, "Ploop not opened\n");
@@ -127,7 +328,7 @@ int main(int argc, char **argv)
 			}
 			free(file); file = NULL;
 
-			ssize_t ret = plus_read(img, size, offset, map);
+			ssize_t ret = image_io(img, 0, size, offset, map);
 			if (ret != size) {
 				fprintf(stderr, "READ failed: %zd\n", ret);
 				ret = 1;
@@ -162,7 +363,7 @@ int main(int argc, char **argv)
 			}
 			free(file); file = NULL;
 
-			ssize_t ret = plus_write(img, size, offset, map);
+			ssize_t ret = image_io(img, 1, size, offset, map);
 			if (ret != size) {
 				fprintf(stderr, "WRITE failed: %zd\n", ret);
 				ret = 1;
@@ -171,14 +372,239 @@ int main(int argc, char **argv)
 
 			munmap(map, size);
 			close(fd);
+		} else if (strncmp(cmd, "verify ", 7) == 0) {
+			if (!img) {
+				fprintf(stderr, "Ploop not opened\n");
+				ret = 2;
+				goto out;
+			}
+			off_t foff = 0;
+			if (sscanf(cmd + 7, "%zd %zu %ms %zd", &offset, &size,
+						&file, &foff) < 3) {
+				fprintf(stderr, "Can't parse command %s\n", cmd);
+				ret = 2;
+				goto out;
+			}
+
+			int fd = open(file, O_RDONLY);
+			if (fd < 0) {
+				fprintf(stderr, "Can't open %s for reading: %m\n", file);
+				ret = 1;
+				goto out;
+			}
+			void *buf = NULL, *exp = malloc(size ? size : 1);
+			if (!exp || posix_memalign(&buf, 4096,
+						size ? size : 4096)) {
+				fprintf(stderr, "Can't allocate %zu bytes\n", size);
+				ret = 1;
+				goto out;
+			}
+			if (pread(fd, exp, size, foff) != (ssize_t)size) {
+				fprintf(stderr, "Can't read %zu bytes of %s\n",
+						size, file);
+				ret = 1;
+				goto out;
+			}
+			close(fd);
+			free(file); file = NULL;
+
+			ssize_t r = image_io(img, 0, size, offset, buf);
+			if (r != (ssize_t)size) {
+				fprintf(stderr, "READ failed: %zd\n", r);
+				ret = 1;
+				goto out;
+			}
+			for (size_t i = 0; i < size; i++) {
+				if (((char *)buf)[i] != ((char *)exp)[i]) {
+					fprintf(stderr, "VERIFY failed: data "
+							"differ at %zd\n",
+							offset + (off_t)i);
+					ret = 1;
+					goto out;
+				}
+			}
+
+			free(buf);
+			free(exp);
+		} else if (strncmp(cmd, "extent ", 7) == 0) {
+			if (!img) {
+				fprintf(stderr, "Ploop not opened\n");
+				ret = 2;
+				goto out;
+			}
+			int level;
+			off_t pos;
+			if (sscanf(cmd + 7, "%zd %d %zd", &offset, &level,
+						&pos) != 3) {
+				fprintf(stderr, "Can't parse command %s\n", cmd);
+				ret = 2;
+				goto out;
+			}
+			struct plus_extent ext;
+			int n = plus_map_extents(img, offset, 1, &ext, 1);
+			if (n != 1) {
+				fprintf(stderr, "EXTENT failed: %d\n", n);
+				ret = 1;
+				goto out;
+			}
+			printf("extent: level %d pos %zd\n", ext.level,
+					ext.level < 0 ? 0 : ext.pos);
+			if (ext.level != level ||
+					(level >= 0 && ext.pos != pos)) {
+				fprintf(stderr, "EXTENT mismatch: expected "
+						"level %d pos %zd\n", level, pos);
+				ret = 1;
+				goto out;
+			}
+		} else if (strncmp(cmd, "flush", 5) == 0) {
+			if (!img) {
+				fprintf(stderr, "Ploop not opened\n");
+				ret = 2;
+				goto out;
+			}
+			int r = plus_flush(img);
+			if (r) {
+				fprintf(stderr, "FLUSH failed: %d\n", r);
+				ret = 1;
+				goto out;
+			}
 		} else if (strncmp(cmd, "close", 5) == 0) {
 			if (!img) {
 				fprintf(stderr, "Ploop not opened\n");
 				ret = 2;
 				goto out;
 			}
+			plus_ring_close(ring);
+			ring = NULL;
 			plus_close(img);
 			img = NULL;
+		} else if (strncmp(cmd, "ring ", 5) == 0) {
+			if (img) {
+				fprintf(stderr, "Can't change ring depth "
+						"with ploop opened\n");
+				ret = 2;
+				goto out;
+			}
+			if (sscanf(cmd + 5, "%u", &ring_depth) != 1) {
+				fprintf(stderr, "Can't parse command %s\n", cmd);
+				ret = 2;
+				goto out;
+			}
+		} else if (strncmp(cmd, "cache ", 6) == 0) {
+			if (img) {
+				fprintf(stderr, "Can't change cache size "
+						"with ploop opened\n");
+				ret = 2;
+				goto out;
+			}
+			if (sscanf(cmd + 6, "%zu", &cache_size) != 1) {
+				fprintf(stderr, "Can't parse command %s\n", cmd);
+				ret = 2;
+				goto out;
+			}
+		} else if (strncmp(cmd, "mmap ", 5) == 0) {
+			if (img) {
+				fprintf(stderr, "Can't change mmap mode "
+						"with ploop opened\n");
+				ret = 2;
+				goto out;
+			}
+			use_mmap = strcmp(cmd + 5, "on") == 0;
+		} else if (strncmp(cmd, "vectored ", 9) == 0) {
+			use_vec = strcmp(cmd + 9, "on") == 0;
+		} else if (strncmp(cmd, "readahead ", 10) == 0) {
+			if (img) {
+				fprintf(stderr, "Can't change readahead "
+						"with ploop opened\n");
+				ret = 2;
+				goto out;
+			}
+			if (sscanf(cmd + 10, "%d %zu", &ra_threads,
+						&ra_window) != 2) {
+				fprintf(stderr, "Can't parse command %s\n", cmd);
+				ret = 2;
+				goto out;
+			}
+		} else if (strncmp(cmd, "writeback ", 10) == 0) {
+			if (img) {
+				fprintf(stderr, "Can't change write-back "
+						"staging with ploop opened\n");
+				ret = 2;
+				goto out;
+			}
+			if (sscanf(cmd + 10, "%zu %u", &wb_size,
+						&wb_age) != 2) {
+				fprintf(stderr, "Can't parse command %s\n", cmd);
+				ret = 2;
+				goto out;
+			}
+		} else if (strncmp(cmd, "merge ", 6) == 0) {
+			if (!img) {
+				fprintf(stderr, "Ploop not opened\n");
+				ret = 2;
+				goto out;
+			}
+			int level;
+			if (sscanf(cmd + 6, "%d", &level) != 1) {
+				fprintf(stderr, "Can't parse command %s\n", cmd);
+				ret = 2;
+				goto out;
+			}
+			int r = plus_merge(img, level);
+			if (r) {
+				fprintf(stderr, "MERGE failed: %d\n", r);
+				ret = 1;
+				goto out;
+			}
+		} else if (strncmp(cmd, "discard ", 8) == 0) {
+			if (!img) {
+				fprintf(stderr, "Ploop not opened\n");
+				ret = 2;
+				goto out;
+			}
+			if (sscanf(cmd + 8, "%zd %zu", &offset, &size) != 2) {
+				fprintf(stderr, "Can't parse command %s\n", cmd);
+				ret = 2;
+				goto out;
+			}
+			int r = plus_discard(img, size, offset);
+			if (r) {
+				fprintf(stderr, "DISCARD failed: %d\n", r);
+				ret = 1;
+				goto out;
+			}
+		} else if (strncmp(cmd, "snapshot ", 9) == 0) {
+			if (!img) {
+				fprintf(stderr, "Ploop not opened\n");
+				ret = 2;
+				goto out;
+			}
+			int r = plus_snapshot(img, cmd + 9);
+			if (r) {
+				fprintf(stderr, "SNAPSHOT failed: %d\n", r);
+				ret = 1;
+				goto out;
+			}
+		} else if (strncmp(cmd, "stats", 5) == 0) {
+			if (!img) {
+				fprintf(stderr, "Ploop not opened\n");
+				ret = 2;
+				goto out;
+			}
+			struct plus_cache_stats st;
+			plus_cache_stats(img, &st);
+			printf("cache: %llu hits, %llu misses (%llu ghost), "
+					"%llu evictions, %llu invalidations, "
+					"%llu bytes used, %llu read ahead "
+					"(%llu hits)\n",
+					(unsigned long long)st.hits,
+					(unsigned long long)st.misses,
+					(unsigned long long)st.ghost_hits,
+					(unsigned long long)st.evictions,
+					(unsigned long long)st.invalidations,
+					(unsigned long long)st.size,
+					(unsigned long long)st.prefetched,
+					(unsigned long long)st.prefetch_hits);
 		} else {
 			fprintf(stderr, "Unknown cmd: %s\n", cmd);
 			ret = 2;
@@ -189,6 +615,7 @@ int main(int argc, char **argv)
 	printf("%s %s: PASS\n", self, cmdfile);
 
 out:
+	plus_ring_close(ring);
 	if (img)
 		plus_close(img);
 	fclose(f);
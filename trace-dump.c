@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "plus-trace.h"
+
+// Decode trace files written with PLUS_TRACE=PREFIX, see plus-trace.h.
+// Events from all the files are merged and printed in time order.
+
+static const char *self; // argv[0]
+
+static const char *names[TR_MAX] = {
+	[TR_READ]	= "read",
+	[TR_WRITE]	= "write",
+	[TR_RUN]	= "R",
+	[TR_REWRITE]	= "W",
+	[TR_ALLOC]	= "A",
+	[TR_GROW]	= "G",
+	[TR_FLUSH]	= "flush",
+	[TR_RING_READ]	= "ring read",
+	[TR_RING_WRITE]	= "ring write",
+	[TR_RING_DONE]	= "ring done",
+	[TR_MERGE]	= "merge",
+	[TR_SNAPSHOT]	= "snapshot",
+	[TR_DISCARD]	= "discard",
+	[TR_FREE]	= "F",
+	[TR_ZERO]	= "Z",
+	[TR_READAHEAD]	= "readahead",
+	[TR_STAGE]	= "S",
+};
+
+static void usage(int x)
+{
+	printf("Usage: %s TRACE_FILE ...\n", basename(self));
+	exit(x);
+}
+
+struct trace {
+	const char *name;
+	u32 tid;
+	struct trace_event *ev;
+	u64 pos, end;	// events left to print
+	u32 mask;
+};
+
+static int open_trace(const char *name, struct trace *t)
+{
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error: can't open %s: %m\n", name);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "Error: can't stat %s: %m\n", name);
+		close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(struct trace_hdr)) {
+		fprintf(stderr, "Error: %s: file too small\n", name);
+		close(fd);
+		return -1;
+	}
+	struct trace_hdr *h = mmap(NULL, st.st_size, PROT_READ,
+			MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		fprintf(stderr, "Error: %s: mmap failed: %m\n", name);
+		return -1;
+	}
+
+	u32 n = h->nevents;
+	if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) ||
+			n == 0 || (n & (n - 1)) ||
+			sizeof(*h) + (size_t)n * sizeof(*t->ev) >
+			(size_t)st.st_size) {
+		fprintf(stderr, "Error: %s: not a trace file\n", name);
+		munmap(h, st.st_size);
+		return -1;
+	}
+
+	t->name = name;
+	t->tid = h->tid;
+	t->ev = (struct trace_event *)(h + 1);
+	t->mask = n - 1;
+	t->end = h->head;
+	// the ring might have wrapped around
+	t->pos = t->end > n ? t->end - n : 0;
+	if (t->pos) {
+		fprintf(stderr, "%s: %llu older events lost\n", name,
+				(unsigned long long)t->pos);
+	}
+
+	return 0;
+}
+
+static void print_event(struct trace *t, struct trace_event *e, u64 start)
+{
+	u64 ts = e->ts - start;
+	const char *name = e->type < TR_MAX ? names[e->type] : "?";
+
+	printf("%6llu.%06llu %6u %-10s ", (unsigned long long)ts / 1000000000,
+			(unsigned long long)ts / 1000 % 1000000, t->tid, name);
+	switch (e->type) {
+	case TR_READ:
+	case TR_WRITE:
+	case TR_RING_READ:
+	case TR_RING_WRITE:
+	case TR_DISCARD:
+	case TR_READAHEAD:
+		printf("idx=%5u off=%5u size=%5llu\n",
+				e->idx, e->off, (unsigned long long)e->len);
+		break;
+	case TR_GROW:
+		printf("%5u +%llu\n", e->idx, (unsigned long long)e->len);
+		break;
+	case TR_FLUSH:
+		printf("%llu BAT updates\n", (unsigned long long)e->len);
+		break;
+	case TR_SNAPSHOT:
+		printf("level %u, writes held for %llu us\n", e->lvl,
+				(unsigned long long)e->len / 1000);
+		break;
+	case TR_MERGE:
+		printf("%5u -> %2u, %5u +%llu\n", e->idx, e->lvl, e->blk,
+				(unsigned long long)e->len);
+		break;
+	case TR_RING_DONE:
+		if (e->blk) {
+			printf("%5u -> %2u, %5u  ", e->idx, e->lvl, e->blk);
+		}
+		printf("res=%lld\n", (long long)(int64_t)e->len);
+		break;
+	default:
+		printf("%5u -> %2u, %5u  off=%5u size=%5llu\n",
+				e->idx, e->lvl, e->blk, e->off,
+				(unsigned long long)e->len);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	self = argv[0];
+	argv++; argc--;
+
+	if (argc < 1) {
+		fprintf(stderr, "Error: invalid number of arguments\n");
+		usage(1);
+	}
+
+	struct trace *t = calloc(argc, sizeof(*t));
+	if (!t) {
+		perror("calloc");
+		return 1;
+	}
+	for (int i = 0; i < argc; i++) {
+		if (open_trace(argv[i], &t[i])) {
+			return 1;
+		}
+	}
+
+	// Timestamps are printed relative to the first event
+	u64 start = ~0ULL;
+	for (int i = 0; i < argc; i++) {
+		if (t[i].pos < t[i].end &&
+				t[i].ev[t[i].pos & t[i].mask].ts < start) {
+			start = t[i].ev[t[i].pos & t[i].mask].ts;
+		}
+	}
+
+	// Merge the per-thread streams, each of which is already sorted
+	for (;;) {
+		struct trace *min = NULL;
+		for (int i = 0; i < argc; i++) {
+			if (t[i].pos == t[i].end) {
+				continue;
+			}
+			struct trace_event *e = &t[i].ev[t[i].pos & t[i].mask];
+			if (!min || e->ts < min->ev[min->pos & min->mask].ts) {
+				min = &t[i];
+			}
+		}
+		if (!min) {
+			break;
+		}
+		print_event(min, &min->ev[min->pos & min->mask], start);
+		min->pos++;
+	}
+
+	return 0;
+}